@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Time the rendering of a deep tree, where every line carries a long
+# prefix: a chain of DEPTH directories with FILES files at each level.
+# Prints the best of RUNS runs of the scan and rendering together, and,
+# when the build has --load-index, of the rendering alone from a snapshot.
+#   bench/deep.sh [DEPTH] [FILES] [RUNS]
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+dirtree=${DIRTREE:-$bench/../dirtree}
+depth=${1:-64}
+files=${2:-2000}
+runs=${3:-10}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+dir=$tmp/tree
+"$bench/mktree.sh" "$dir" 1 "$depth" "$files"
+
+# Best wall time of a command over the runs, in milliseconds
+best_ms() {
+    local best=
+    for ((r = 0; r < runs; r++)); do
+        local start=$(date +%s%N)
+        "$@" > /dev/null
+        local ms=$(( ($(date +%s%N) - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+# Print a timing with the throughput of the text
+report() {
+    local ms=$2
+    echo "$1: ${ms} ms, $(awk "BEGIN { printf \"%.1f\", $bytes / ($ms ? $ms : 1) / 1000 }") MB/s"
+}
+
+bytes=$("$dirtree" -a "$dir" | wc -c)
+echo "$bytes bytes of text"
+report "scan and render" "$(best_ms "$dirtree" -a "$dir")"
+
+if "$dirtree" --help 2>&1 | grep -q -- --load-index; then
+    "$dirtree" -a --save-index="$tmp/index" "$dir" > /dev/null
+    report "render from a snapshot" "$(best_ms "$dirtree" --load-index="$tmp/index")"
+fi
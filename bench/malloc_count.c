@@ -0,0 +1,54 @@
+/*
+ * Allocation counter: preloaded into a program, counts the calls to the
+ * glibc allocator and prints them to stderr on exit.
+ *
+ *   gcc -O2 -shared -fPIC -o bench/malloc_count.so bench/malloc_count.c
+ *   LD_PRELOAD=bench/malloc_count.so ./dirtree -a DIR > /dev/null
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_ulong mallocs;
+static atomic_ulong callocs;
+static atomic_ulong reallocs;
+static atomic_ulong frees;
+static atomic_ulong bytes;
+
+void *malloc(size_t size) {
+    atomic_fetch_add(&mallocs, 1);
+    atomic_fetch_add(&bytes, size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    atomic_fetch_add(&callocs, 1);
+    atomic_fetch_add(&bytes, count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add(&reallocs, 1);
+    atomic_fetch_add(&bytes, size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr) {
+        atomic_fetch_add(&frees, 1);
+    }
+    __libc_free(ptr);
+}
+
+__attribute__((destructor))
+static void report(void) {
+    fprintf(stderr, "malloc %lu, calloc %lu, realloc %lu, free %lu, %lu bytes requested\n",
+            (unsigned long)mallocs, (unsigned long)callocs, (unsigned long)reallocs,
+            (unsigned long)frees, (unsigned long)bytes);
+}
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Build a synthetic tree for the benchmarks: FANOUT subdirectories per
+# directory down to DEPTH levels, with FILES files in each directory.
+#   bench/mktree.sh DIR [FANOUT] [DEPTH] [FILES]
+set -e
+
+dir=${1:?usage: mktree.sh DIR [FANOUT] [DEPTH] [FILES]}
+fanout=${2:-8}
+depth=${3:-4}
+files=${4:-20}
+
+if [ -e "$dir" ]; then
+    echo "$dir already exists" >&2
+    exit 1
+fi
+mkdir -p "$dir"
+
+level=("$dir")
+for ((d = 0; d < depth; d++)); do
+    next=()
+    for parent in "${level[@]}"; do
+        for ((i = 0; i < fanout; i++)); do
+            next+=("$parent/dir_$i")
+        done
+    done
+    mkdir "${next[@]}"
+    level=("${next[@]}")
+done
+
+# Fill every directory, the root included
+find "$dir" -type d | while read -r d; do
+    for ((i = 0; i < files; i++)); do
+        echo "$d/file_$i.txt"
+    done
+done | xargs touch
+
+echo "$(find "$dir" -type d | wc -l) directories, $(find "$dir" -type f | wc -l) files in $dir"
@@ -0,0 +1,96 @@
+/*
+ * Rendering throughput of dirtree_generate_string: the best time of RUNS
+ * renderings of a tree, from disk and from a snapshot of it, each with no
+ * output_size_hint and with the size the previous run reported.
+ *
+ *   gcc -O2 -D_GNU_SOURCE -DDIRTREE_LIBRARY_ONLY -pthread -I. \
+ *       -o bench/render bench/render.c dirtree.c
+ *   bench/render DIR [RUNS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dirtree.h"
+
+// Seconds on the monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Render RUNS times and print the best time and its throughput
+static int measure(const char *label, const char *dir, DirtreeConfig *config, int runs) {
+    double best = 0;
+    size_t bytes = 0;
+    for (int r = 0; r < runs; r++) {
+        double start = now();
+        char *text = dirtree_generate_string(dir, config);
+        double elapsed = now() - start;
+        if (!text) {
+            fprintf(stderr, "%s: rendering failed\n", label);
+            return -1;
+        }
+        bytes = strlen(text);
+        free(text);
+        if (r == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    printf("%-24s %8.2f ms %8.1f MB/s (%zu bytes)\n", label, best * 1e3,
+           bytes / best / 1e6, bytes);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s DIR [RUNS]\n", argv[0]);
+        return 1;
+    }
+    const char *dir = argv[1];
+    int runs = argc > 2 ? atoi(argv[2]) : 10;
+
+    DirtreeStats stats;
+    DirtreeConfig config;
+    dirtree_init_config(&config);
+    config.skip_common = false;
+    config.stats = &stats;
+
+    // Warm the cache and learn the output size
+    char *text = dirtree_generate_string(dir, &config);
+    size_t size = text ? strlen(text) : 0;
+    free(text);
+
+    int failed = measure("disk, no hint", dir, &config, runs);
+    config.output_size_hint = size;
+    failed |= measure("disk, hint", dir, &config, runs);
+
+    // The same tree from a snapshot, so only the rendering is timed
+    char path[] = "/tmp/dirtree-render-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (fd < 0 || dirtree_index_save(dir, path, &config) != 0) {
+        fprintf(stderr, "can't save a snapshot of %s\n", dir);
+        return 1;
+    }
+    DirtreeIndex *index = dirtree_index_load(path, NULL);
+    remove(path);
+    if (!index) {
+        fprintf(stderr, "can't load the snapshot of %s\n", dir);
+        return 1;
+    }
+    config.index = index;
+    config.output_size_hint = 0;
+    failed |= measure("snapshot, no hint", dir, &config, runs);
+    config.output_size_hint = size;
+    failed |= measure("snapshot, hint", dir, &config, runs);
+
+    dirtree_index_close(index);
+    dirtree_free_config(&config);
+    return failed ? 1 : 0;
+}
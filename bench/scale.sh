@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Time a full scan of a tree with 1 to N scanner threads (-j), best of
+# RUNS runs each, and print the speedup over one thread. Without DIR a
+# synthetic tree is built in a temporary directory first.
+#   bench/scale.sh [DIR] [MAX_THREADS] [RUNS]
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+dirtree=${DIRTREE:-$bench/../dirtree}
+max=${2:-$(nproc)}
+runs=${3:-5}
+
+dir=$1
+if [ -z "$dir" ]; then
+    tmp=$(mktemp -d)
+    trap 'rm -rf "$tmp"' EXIT
+    dir=$tmp/tree
+    "$bench/mktree.sh" "$dir" 8 4 20
+fi
+
+# Best wall time of a command over the runs, in milliseconds
+best_ms() {
+    local best=
+    for ((r = 0; r < runs; r++)); do
+        local start=$(date +%s%N)
+        "$@" > /dev/null
+        local ms=$(( ($(date +%s%N) - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+# Warm the cache so every thread count reads the same state
+"$dirtree" -a "$dir" > /dev/null
+
+base=
+for ((n = 1; n <= max; n *= 2)); do
+    ms=$(best_ms "$dirtree" -a -j "$n" "$dir")
+    base=${base:-$ms}
+    echo "-j $n: ${ms} ms ($(awk "BEGIN { printf \"%.2f\", $base / ($ms ? $ms : 1) }")x)"
+    if [ "$n" -lt "$max" ] && [ $((n * 2)) -gt "$max" ]; then
+        n=$((max / 2))
+    fi
+done
@@ -20,8 +20,8 @@ x86_64-w64-mingw32-gcc -Wall -std=c99 -D_WIN32 -DDIRTREE_LIBRARY_ONLY -shared \
 
 echo "Library build completed successfully."
 echo "Files created:"
-echo "  - libdirtree.so.1.0.0 (Linux shared library)"
-echo "  - libdirtree.so.1 (symlink)"
+echo "  - libdirtree.so.2.0.0 (Linux shared library)"
+echo "  - libdirtree.so.2 (symlink)"
 echo "  - libdirtree.so (symlink)"
 echo "  - libdirtree.dll (Windows shared library)"
 echo "  - dirtree (executable)"
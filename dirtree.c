@@ -11,6 +11,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 
 // For strdup() and PATH_MAX
 // Note: _GNU_SOURCE is already defined in the Makefile
@@ -32,8 +35,33 @@
     // Don't redefine PATH_MAX as it's already defined in Windows headers
 #else
     #include <dirent.h>
+    #include <fcntl.h>
     #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <sys/resource.h>
     #include <unistd.h>
+    #include <pthread.h>
+    // Parallel scanning is only offered on POSIX threads
+    #define DIRTREE_HAVE_THREADS 1
+    #ifdef __linux__
+        #include <sys/syscall.h>
+        #include <linux/version.h>
+        // IORING_OP_STATX arrived in Linux 5.6
+        #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+            #define DIRTREE_HAVE_IO_URING 1
+            #include <linux/io_uring.h>
+        #endif
+        // Watch mode follows changes through inotify
+        #define DIRTREE_HAVE_INOTIFY 1
+        #include <sys/inotify.h>
+        #include <poll.h>
+    #endif
+    // Systems without d_type report every entry as unknown
+    #ifndef _DIRENT_HAVE_D_TYPE
+        #define DT_UNKNOWN 0
+        #define DT_DIR 4
+        #define DT_LNK 10
+    #endif
     // Define PATH_MAX if not defined
     #ifndef PATH_MAX
         #define PATH_MAX 4096
@@ -41,17 +69,24 @@
 #endif
 
 // Tree drawing characters for different formats
-static const char *tree_chars[2][4] = {
+typedef struct {
+    const char *str;
+    size_t len;
+} TreePiece;
+
+#define TREE_PIECE(s) { s, sizeof(s) - 1 }
+
+static const TreePiece tree_chars[2][4] = {
     // ASCII characters
-    {"|-- ", "+-- ", "|   ", "    "},
+    {TREE_PIECE("|-- "), TREE_PIECE("+-- "), TREE_PIECE("|   "), TREE_PIECE("    ")},
     // Unicode characters
-    {"├── ", "└── ", "│   ", "    "}
+    {TREE_PIECE("├── "), TREE_PIECE("└── "), TREE_PIECE("│   "), TREE_PIECE("    ")}
 };
 
-#define TREE_BRANCH(fmt) (tree_chars[fmt][0])
-#define TREE_CORNER(fmt) (tree_chars[fmt][1])
-#define TREE_VERTICAL(fmt) (tree_chars[fmt][2])
-#define TREE_SPACE(fmt) (tree_chars[fmt][3])
+#define TREE_BRANCH(fmt) (&tree_chars[fmt][0])
+#define TREE_CORNER(fmt) (&tree_chars[fmt][1])
+#define TREE_VERTICAL(fmt) (&tree_chars[fmt][2])
+#define TREE_SPACE(fmt) (&tree_chars[fmt][3])
 
 // Default skiplist - directories to skip
 static const char *default_skiplist[] = {
@@ -89,555 +124,5845 @@ static const char *default_skipfiles[] = {
 };
 
 // Library version
-#define DIRTREE_VERSION "1.0.0"
+#define DIRTREE_VERSION "2.0.0"
+
+// Chunk size in which dirtree_print_to_file writes its output
+#define STREAM_BUFFER_SIZE (64 * 1024)
 
-// Structure to represent a hash table for visited directories
+// Symlinks followed along a single branch before giving up, matching the
+// kernel's MAXSYMLINKS so link loops terminate
+#define MAX_SYMLINK_HOPS 40
+
+// Identity of a directory: device and inode on POSIX, volume serial number
+// and file index on Windows. Both zero marks an empty hash slot.
 typedef struct {
-    char **paths;
-    int size;
-    int capacity;
+    uint64_t dev;
+    uint64_t ino;
+} DirId;
+
+// Open-addressing hash set of visited directories, keyed on DirId
+typedef struct {
+    DirId *slots;
+    size_t size;
+    size_t capacity;             // Always a power of two
 } VisitedDirs;
 
+// Directories on the branch currently being walked, for the ancestor-only
+// cycle policy
+typedef struct {
+    DirId *ids;
+    int depth;
+    int capacity;
+} AncestorStack;
+
+// Snapshot file layout: an IndexHeader, then node_count IndexNodes in the
+// order the tree is printed (each directory followed by its subtree), then
+// a string table of NUL-terminated names. Integers use the saving host's
+// byte order, recorded in byte_order, so the file is mapped and read in
+// place; a snapshot from a host of the other byte order is rejected.
+#define INDEX_MAGIC "DIRTIDX"
+#define INDEX_VERSION 2
+#define INDEX_BYTE_ORDER 0x01020304u
+
+// No snapshot node: DirEntry.node of an entry with no counterpart
+#define INDEX_NONE UINT32_MAX
+
+// IndexNode flags
+#define INDEX_NODE_DIR 0x01
+#define INDEX_NODE_LINK 0x02         // Reached through a symlink
+#define INDEX_NODE_LISTED 0x04       // Directory was read; its entries follow it
+#define INDEX_NODE_METADATA 0x08     // size and mtime are set
+#define INDEX_NODE_STAMPED 0x10      // Directory's mtime, ctime, ino and dev are set
+#define INDEX_NODE_LINKS_DROPPED 0x20 // Directory's listing left out symlinks for what they point to
+
+typedef struct {
+    char magic[8];               // INDEX_MAGIC
+    uint32_t version;            // INDEX_VERSION
+    uint32_t byte_order;         // INDEX_BYTE_ORDER as the saving host stores it
+    uint32_t header_size;        // sizeof(IndexHeader)
+    uint32_t node_size;          // sizeof(IndexNode)
+    uint32_t node_count;         // At least 1: node 0 is the root
+    uint32_t reserved;
+    uint64_t rules;              // Fingerprint of the settings that chose the entries
+    uint64_t strings_offset;     // Right after the nodes
+    uint64_t strings_size;
+    uint64_t file_size;
+    int64_t scan_started;        // When the scan began, nanoseconds since the epoch
+} IndexHeader;
+
+typedef struct {
+    uint32_t name;               // Offset in the string table; the root's is its absolute path
+    uint32_t name_len;
+    uint32_t parent;             // Index of the parent node; the root is its own parent
+    uint32_t end;                // One past the last node of this subtree
+    uint32_t flags;              // INDEX_NODE_*
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtime;               // Nanoseconds since the epoch
+    int64_t ctime;               // Directories only, like ino and dev
+    uint64_t ino;
+    uint64_t dev;
+} IndexNode;
+
+// A snapshot file mapped into memory (read into it on Windows), or one
+// built in memory by a watch
+struct DirtreeIndex {
+    const IndexHeader *header;
+    const IndexNode *nodes;
+    const char *strings;
+    void *data;
+    size_t size;
+    bool allocated;              // data comes from malloc() rather than mmap()
+};
+
+// A directory changed this close to the start of a scan may have changed
+// again within the same timestamp tick (2s on FAT), so a baseline only
+// vouches for directories stamped before this much ahead of its scan
+#define BASELINE_RACY_NS (2000000000LL)
+
+// Fingerprint the settings that decide which entries a scan keeps (FNV-1a
+// over their values), so a snapshot's listings are only reused by walks
+// that would have listed the same entries
+static uint64_t rules_fingerprint(const DirtreeConfig *config) {
+    uint64_t h = 14695981039346656037ULL;
+    int values[4] = { config->max_depth, config->skip_hidden, config->skip_common,
+                      (int)config->cycle_policy };
+    const unsigned char *bytes = (const unsigned char *)values;
+    for (size_t i = 0; i < sizeof(values); i++) {
+        h = (h ^ bytes[i]) * 1099511628211ULL;
+    }
+    if (config->use_ignore_files) {
+        h = (h ^ 0xFE) * 1099511628211ULL;
+    }
+    
+    // Custom names only count when skipping is enabled; each ends with its NUL
+    char **lists[2] = { config->custom_skip_dirs, config->custom_skip_files };
+    for (int l = 0; l < 2 && config->skip_common; l++) {
+        for (int i = 0; lists[l] && lists[l][i]; i++) {
+            const unsigned char *p = (const unsigned char *)lists[l][i];
+            do {
+                h = (h ^ *p) * 1099511628211ULL;
+            } while (*p++);
+        }
+        h = (h ^ 0xFF) * 1099511628211ULL;
+    }
+    
+    // Filters count whether skipping is enabled or not; they are left out
+    // when unused so fingerprints without them stay the same
+    char **filters[3] = { config->include_patterns, config->include_extensions,
+                          config->exclude_patterns };
+    for (int l = 0; l < 3; l++) {
+        for (int i = 0; filters[l] && filters[l][i]; i++) {
+            const unsigned char *p = (const unsigned char *)filters[l][i];
+            do {
+                h = (h ^ *p) * 1099511628211ULL;
+            } while (*p++);
+        }
+        if (filters[l] && filters[l][0]) {
+            h = (h ^ (0xF0 + l)) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+// Nanoseconds since the epoch of one of a struct stat's timestamps
+#ifdef __APPLE__
+    #define STAT_TIME_NS(st, which) \
+        ((int64_t)(st).st_##which##timespec.tv_sec * 1000000000 + (st).st_##which##timespec.tv_nsec)
+#else
+    #define STAT_TIME_NS(st, which) \
+        ((int64_t)(st).st_##which##tim.tv_sec * 1000000000 + (st).st_##which##tim.tv_nsec)
+#endif
+
+// What prune_empty found out about a listed directory
+#define PRUNE_UNKNOWN 0          // Not looked into yet
+#define PRUNE_SHOWN 1            // Something below it is shown, or it isn't entered at all
+#define PRUNE_EMPTY 2            // Read, and nothing below it is shown: left out
+
 // Structure to hold directory entry information
 typedef struct {
-    char *path;
+    char *path;      // Full path, Windows only: FindFirstFile needs it
     char *name;
+    unsigned int name_len;
     bool is_dir;
+    bool is_link;    // Reached through a symlink
+    bool needs_stat; // Type still unknown, resolved by a batched statx
+    unsigned char d_type;
+    unsigned char prune; // PRUNE_*: whether prune_empty shows it (directories only)
+    uint32_t node;   // Its snapshot node: the one it was read from (config->index),
+                     // else its counterpart in the baseline or INDEX_NONE
 } DirEntry;
 
+// Entries of a listing cut by max_children_per_dir, summarized in one line
+typedef struct {
+    int files;
+    int dirs;
+} ListingRest;
+
 // Compare function for qsort
 static int compare_entries(const void *a, const void *b) {
     return strcmp(((DirEntry *)a)->name, ((DirEntry *)b)->name);
 }
 
-// Initialize the visited directories hash table
-static void init_visited_dirs(VisitedDirs *visited, int capacity) {
-    visited->paths = (char **)malloc(capacity * sizeof(char *));
-    if (!visited->paths) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
-    }
+// Initialize the visited directories hash table. Returns false if out of memory.
+static bool init_visited_dirs(VisitedDirs *visited, size_t capacity) {
+    visited->slots = (DirId *)calloc(capacity, sizeof(DirId));
     visited->size = 0;
-    visited->capacity = capacity;
-    for (int i = 0; i < capacity; i++) {
-        visited->paths[i] = NULL;
-    }
+    visited->capacity = visited->slots ? capacity : 0;
+    return visited->slots != NULL;
 }
 
-// Check if a directory has been visited
-static bool is_visited(VisitedDirs *visited, const char *path) {
-    for (int i = 0; i < visited->size; i++) {
-        if (strcmp(visited->paths[i], path) == 0) {
-            return true;
+// Spread a directory identity over the table (64-bit mix of both halves)
+static size_t hash_dir_id(DirId id) {
+    uint64_t h = id.ino * 0x9E3779B97F4A7C15ULL ^ id.dev;
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+    return (size_t)h;
+}
+
+// Find the slot holding id, or the empty slot where it belongs
+static DirId *find_visited_slot(DirId *slots, size_t capacity, DirId id) {
+    size_t mask = capacity - 1;
+    size_t i = hash_dir_id(id) & mask;
+    while (slots[i].dev != 0 || slots[i].ino != 0) {
+        if (slots[i].dev == id.dev && slots[i].ino == id.ino) {
+            break;
         }
+        i = (i + 1) & mask;
     }
-    return false;
+    return &slots[i];
 }
 
-// Mark a directory as visited
-static void mark_visited(VisitedDirs *visited, const char *path) {
-    if (visited->size >= visited->capacity) {
-        visited->capacity *= 2;
-        visited->paths = (char **)realloc(visited->paths, visited->capacity * sizeof(char *));
-        if (!visited->paths) {
-            perror("Memory reallocation failed");
-            exit(EXIT_FAILURE);
-        }
+// Mark a directory as visited. Returns 1 if it is new, 0 if it was
+// already visited and -1 if the table could not grow.
+static int mark_visited(VisitedDirs *visited, DirId id) {
+    DirId *slot = find_visited_slot(visited->slots, visited->capacity, id);
+    if (slot->dev != 0 || slot->ino != 0) {
+        return 0;
     }
     
-    // Use strdup with proper casting
-    visited->paths[visited->size] = (char *)strdup(path);
-    if (!visited->paths[visited->size]) {
-        perror("String duplication failed");
-        exit(EXIT_FAILURE);
+    // Keep the load factor under 3/4 so probe runs stay short
+    if ((visited->size + 1) * 4 > visited->capacity * 3) {
+        size_t new_capacity = visited->capacity * 2;
+        DirId *slots = (DirId *)calloc(new_capacity, sizeof(DirId));
+        if (!slots) {
+            return -1;
+        }
+        for (size_t i = 0; i < visited->capacity; i++) {
+            DirId old = visited->slots[i];
+            if (old.dev != 0 || old.ino != 0) {
+                *find_visited_slot(slots, new_capacity, old) = old;
+            }
+        }
+        free(visited->slots);
+        visited->slots = slots;
+        visited->capacity = new_capacity;
+        slot = find_visited_slot(visited->slots, visited->capacity, id);
     }
+    
+    *slot = id;
     visited->size++;
+    return 1;
+}
+
+// Check whether a directory is in the set
+static bool is_visited(const VisitedDirs *visited, DirId id) {
+    const DirId *slot = find_visited_slot(visited->slots, visited->capacity, id);
+    return slot->dev == id.dev && slot->ino == id.ino;
 }
 
 // Free the visited directories hash table
 static void free_visited_dirs(VisitedDirs *visited) {
-    for (int i = 0; i < visited->size; i++) {
-        free(visited->paths[i]);
+    free(visited->slots);
+    visited->slots = NULL;
+}
+
+// Check whether a directory is already open further up the current branch
+static bool is_ancestor(const AncestorStack *stack, DirId id) {
+    for (int i = stack->depth - 1; i >= 0; i--) {
+        if (stack->ids[i].dev == id.dev && stack->ids[i].ino == id.ino) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Enter a directory on the current branch. Returns false if out of memory.
+static bool push_ancestor(AncestorStack *stack, DirId id) {
+    if (stack->depth >= stack->capacity) {
+        int capacity = stack->capacity ? stack->capacity * 2 : 32;
+        DirId *ids = (DirId *)realloc(stack->ids, capacity * sizeof(DirId));
+        if (!ids) {
+            return false;
+        }
+        stack->ids = ids;
+        stack->capacity = capacity;
     }
-    free(visited->paths);
+    stack->ids[stack->depth++] = id;
+    return true;
 }
 
-// Get absolute path
-static char *get_absolute_path(const char *path) {
+// Reset an error report for a new call
+static void init_error(DirtreeError *error) {
+    memset(error, 0, sizeof(*error));
+}
+
+// Describe a failure, or with DIRTREE_OK a directory that could not be
+// read, by its errno and path. A failure already recorded is kept.
+static void record_error(DirtreeError *error, DirtreeErrorCode code, int sys_errno,
+                         const char *path) {
+    if (error->code != DIRTREE_OK) {
+        return;
+    }
+    error->code = code;
+    error->sys_errno = sys_errno;
+    if (path) {
+        snprintf(error->path, sizeof(error->path), "%s", path);
+    } else {
+        error->path[0] = '\0';
+    }
+}
+
+// Fold the report of one worker into the report of the whole walk
+static void merge_error(DirtreeError *into, const DirtreeError *from) {
+    into->dirs_unreadable += from->dirs_unreadable;
+    into->dirs_skipped += from->dirs_skipped;
+    if (from->code != DIRTREE_OK || from->dirs_unreadable > 0) {
+        record_error(into, from->code, from->sys_errno, from->path);
+    }
+}
+
+// Fail a call before any traversal state exists
+static void fail_call(const DirtreeConfig *config, DirtreeErrorCode code, int sys_errno) {
+    if (config && config->error) {
+        init_error(config->error);
+        record_error(config->error, code, sys_errno, NULL);
+    }
+}
+
+// Get absolute path, recording why it failed in error
+static char *get_absolute_path(const char *path, DirtreeError *error) {
     char abs_path[PATH_MAX];
     
 #ifdef _WIN32
     if (_fullpath(abs_path, path, PATH_MAX) == NULL) {
-        perror("Error getting absolute path");
-        return NULL;
-    }
 #else
     if (realpath(path, abs_path) == NULL) {
-        perror("Error getting absolute path");
+#endif
+        record_error(error, DIRTREE_ERR_PATH, errno, path);
         return NULL;
     }
-#endif
     
-    return (char *)strdup(abs_path);
+    char *result = (char *)strdup(abs_path);
+    if (!result) {
+        record_error(error, DIRTREE_ERR_NOMEM, ENOMEM, path);
+    }
+    return result;
 }
 
-// Check if a directory should be skipped
-static bool should_skip_dir(const char *name, const DirtreeConfig *config) {
-    // If skipping is disabled, return false
-    if (!config->skip_common) {
+// Outcomes of glob_match_from. The aborts tell enclosing '*' loops that
+// trying further positions is useless, as in git's wildmatch, which keeps
+// patterns like "a*a*a*a*b" from backtracking exponentially.
+#define GLOB_NOMATCH 0
+#define GLOB_MATCH 1
+#define GLOB_ABORT_ALL 2             // The text ran out: shorter ones can't match either
+#define GLOB_ABORT_TO_STARSTAR 3     // A '*' reached a '/': only an enclosing "**" can go on
+
+// Match text against the glob from p on (pattern is its start); see glob_match
+static int glob_match_from(const char *pattern, const char *p, const char *text) {
+    for (; *p; p++, text++) {
+        if (*text == '\0' && *p != '*') {
+            return GLOB_ABORT_ALL;
+        }
+        switch (*p) {
+            case '?':
+                if (*text == '/') {
+                    return GLOB_NOMATCH;
+                }
+                break;
+            case '*': {
+                // "**" as a whole component crosses directories
+                bool component_start = p == pattern || p[-1] == '/';
+                if (p[1] == '*' && component_start && (p[2] == '/' || p[2] == '\0')) {
+                    if (p[2] == '\0') {
+                        return GLOB_MATCH;
+                    }
+                    for (const char *t = text; ; t++) {
+                        int matched = glob_match_from(pattern, p + 3, t);
+                        if (matched == GLOB_MATCH || matched == GLOB_ABORT_ALL) {
+                            return matched;
+                        }
+                        t = strchr(t, '/');
+                        if (!t) {
+                            return GLOB_NOMATCH;
+                        }
+                    }
+                }
+                while (p[1] == '*') {
+                    p++;
+                }
+                if (p[1] == '\0') {
+                    return strchr(text, '/') ? GLOB_ABORT_TO_STARSTAR : GLOB_MATCH;
+                }
+                for (const char *t = text; ; t++) {
+                    int matched = glob_match_from(pattern, p + 1, t);
+                    if (matched != GLOB_NOMATCH) {
+                        return matched;
+                    }
+                    if (*t == '\0') {
+                        return GLOB_ABORT_ALL;
+                    }
+                    if (*t == '/') {
+                        return GLOB_ABORT_TO_STARSTAR;
+                    }
+                }
+            }
+            case '[': {
+                if (*text == '/') {
+                    return GLOB_NOMATCH;
+                }
+                const char *c = p + 1;
+                bool negate = *c == '!' || *c == '^';
+                if (negate) {
+                    c++;
+                }
+                bool matched = false;
+                bool first = true;
+                for (; *c && (first || *c != ']'); c++, first = false) {
+                    char low = *c == '\\' && c[1] ? *++c : *c;
+                    char high = low;
+                    if (c[1] == '-' && c[2] && c[2] != ']') {
+                        c += 2;
+                        high = *c == '\\' && c[1] ? *++c : *c;
+                    }
+                    if ((unsigned char)*text >= (unsigned char)low &&
+                        (unsigned char)*text <= (unsigned char)high) {
+                        matched = true;
+                    }
+                }
+                if (*c != ']') {
+                    return GLOB_NOMATCH;  // Unterminated class matches nothing, as in git
+                }
+                if (matched == negate) {
+                    return GLOB_NOMATCH;
+                }
+                p = c;
+                break;
+            }
+            case '\\':
+                if (p[1]) {
+                    p++;
+                }
+                // fall through
+            default:
+                // Including the character a '\' quotes
+                if (*text != *p) {
+                    return GLOB_NOMATCH;
+                }
+                break;
+        }
+    }
+    return *text == '\0' ? GLOB_MATCH : GLOB_NOMATCH;
+}
+
+// Match text against a gitignore-style glob: '*' and '?' stay within one
+// path component, "[...]" is a character class ('!' or '^' negates it),
+// '\' quotes the next character, and a "**" component matches any number
+// of directories. Backtracks like git's wildmatch, including its early
+// aborts; this is only reached for the patterns the tables can't answer.
+static bool glob_match(const char *pattern, const char *p, const char *text) {
+    return glob_match_from(pattern, p, text) == GLOB_MATCH;
+}
+
+
+// Extension of a name or pattern tail: what follows its last dot, if any
+static const char *name_extension(const char *name, uint32_t len, uint32_t *ext_len) {
+    for (uint32_t i = len; i > 0; i--) {
+        if (name[i - 1] == '.') {
+            *ext_len = len - i;
+            return name + i;
+        }
+    }
+    return NULL;
+}
+
+// Check that a pattern matches only its own text: no wildcards or quoting
+static bool is_literal_pattern(const char *text, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (text[i] == '*' || text[i] == '?' || text[i] == '[' || text[i] == '\\') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// One skip name in a NameSet slot; name is NULL for an empty slot
+typedef struct {
+    const char *name;
+    uint32_t hash;
+    uint32_t len;
+} NameSlot;
+
+// Open-addressing set of exact names, probed by hash and length before
+// any bytes are compared
+typedef struct {
+    NameSlot *slots;
+    size_t capacity;             // Power of two, or 0 for an empty set
+} NameSet;
+
+// Flags of a gitignore-style pattern, from an ignore file or --include/--exclude
+#define IGNORE_NEGATE 0x01       // "!pattern": re-include what an earlier pattern excluded
+#define IGNORE_DIR_ONLY 0x02     // "pattern/": directories only
+#define IGNORE_ANCHORED 0x04     // Contains a '/': matched against the path below the layer
+
+// An --include or --exclude pattern that needs glob_match
+typedef struct {
+    const char *text;            // Without a leading or trailing '/'; borrowed unless copy
+    char *copy;                  // Owned text, when a trailing '/' was cut off
+    bool anchored;               // Has a '/' before its end: matched against the path below the root
+    bool dir_only;               // Had a trailing '/': matches directories only
+    char **components;           // Anchored only: the '/'-separated parts, NULL-terminated
+} FilterGlob;
+
+// The patterns of one side of the filters. Plain names are found by a
+// hash lookup, "*.ext" patterns by lookups on the entry's extensions,
+// and only the rest go through glob_match.
+typedef struct {
+    bool active;                 // Any pattern at all
+    bool any_unanchored;         // Some pattern is matched against bare names
+    bool any_dir_only;           // Some glob matches directories only
+    NameSet names;
+    NameSet extensions;          // Keyed without the leading dot; may hold several ("tar.gz")
+    FilterGlob *globs;
+    size_t glob_count;
+} FilterSet;
+
+// The skip lists and filters of one traversal, compiled once so each
+// entry costs a hash lookup or two however many names are registered
+typedef struct {
+    bool enabled;                // config->skip_common
+    bool skip_hidden;
+    NameSet dirs;
+    NameSet files;
+    FilterSet include;           // Files must match one of these, when there are any
+    FilterSet exclude;           // Entries matching one of these are left out
+    bool prune_dirs;             // Every include is anchored: directories none can reach are left out
+    bool needs_paths;            // Some filter pattern is anchored, or an include directory-only
+} SkipMatcher;
+
+// FNV-1a hash of a name, measuring its length on the same pass
+static uint32_t hash_name(const char *name, uint32_t *len) {
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)name;
+    while (*p) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    *len = (uint32_t)(p - (const unsigned char *)name);
+    return h;
+}
+
+// Find the slot holding name, or the empty slot where it belongs
+static NameSlot *find_name_slot(const NameSet *set, const char *name, uint32_t hash, uint32_t len) {
+    size_t mask = set->capacity - 1;
+    size_t i = hash & mask;
+    while (set->slots[i].name) {
+        NameSlot *slot = &set->slots[i];
+        if (slot->hash == hash && slot->len == len && memcmp(slot->name, name, len) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &set->slots[i];
+}
+
+// Count the names of a NULL-terminated list (which may itself be NULL)
+static size_t count_names(const char *const *names) {
+    size_t n = 0;
+    while (names && names[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Add a name to a set
+static void add_name(NameSet *set, const char *name) {
+    uint32_t len;
+    uint32_t hash = hash_name(name, &len);
+    NameSlot *slot = find_name_slot(set, name, hash, len);
+    slot->name = name;
+    slot->hash = hash;
+    slot->len = len;
+}
+
+// Add every name of a NULL-terminated list to a set
+static void add_names(NameSet *set, const char *const *names) {
+    for (size_t i = 0; names && names[i]; i++) {
+        add_name(set, names[i]);
+    }
+}
+
+// Allocate an empty set with room for n names, sized to stay under half
+// full. Returns false if out of memory.
+static bool alloc_name_set(NameSet *set, size_t n) {
+    set->capacity = 16;
+    while (set->capacity < n * 2) {
+        set->capacity *= 2;
+    }
+    set->slots = (NameSlot *)calloc(set->capacity, sizeof(NameSlot));
+    if (!set->slots) {
+        set->capacity = 0;
         return false;
     }
-    
-    // Check default skiplist
-    for (int i = 0; default_skiplist[i] != NULL; i++) {
-        if (strcmp(name, default_skiplist[i]) == 0) {
-            return true;
+    return true;
+}
+
+// Build a set from the default and custom lists. Returns false if out of
+// memory.
+static bool compile_name_set(NameSet *set, const char *const *defaults, const char *const *custom) {
+    if (!alloc_name_set(set, count_names(defaults) + count_names(custom))) {
+        return false;
+    }
+    add_names(set, defaults);
+    add_names(set, custom);
+    return true;
+}
+
+// Check whether a set contains name
+static bool name_set_contains(const NameSet *set, const char *name) {
+    uint32_t len;
+    uint32_t hash = hash_name(name, &len);
+    return find_name_slot(set, name, hash, len)->name != NULL;
+}
+
+// Split an anchored pattern into its components, in one allocation that
+// also holds their text. Returns NULL if out of memory.
+static char **split_glob_components(const char *text) {
+    size_t len = strlen(text);
+    size_t count = 1;
+    for (const char *c = text; (c = strchr(c, '/')); c++) {
+        count++;
+    }
+    char **components = (char **)malloc((count + 1) * sizeof(char *) + len + 1);
+    if (!components) {
+        return NULL;
+    }
+    char *copy = (char *)(components + count + 1);
+    memcpy(copy, text, len + 1);
+    size_t n = 0;
+    for (char *part = copy; part; ) {
+        components[n++] = part;
+        part = strchr(part, '/');
+        if (part) {
+            *part++ = '\0';
         }
     }
+    components[n] = NULL;
+    return components;
+}
+
+// Take the slashes off a gitignore-style pattern of *n bytes: a trailing
+// '/' makes it match directories only, and a leading one, or one left in
+// the middle, anchors it. Sets *start to the offset of what remains and
+// *n to its length, and returns its IGNORE_DIR_ONLY and IGNORE_ANCHORED
+// flags.
+static uint32_t strip_pattern_slashes(const char *text, size_t *start, size_t *n) {
+    uint32_t flags = 0;
+    *start = 0;
+    if (*n > 0 && text[*n - 1] == '/') {
+        flags |= IGNORE_DIR_ONLY;
+        (*n)--;
+    }
+    if (*n > 0 && text[0] == '/') {
+        flags |= IGNORE_ANCHORED;
+        *start = 1;
+        (*n)--;
+    }
+    if (*n > 0 && memchr(text + *start, '/', *n)) {
+        flags |= IGNORE_ANCHORED;
+    }
+    return flags;
+}
+
+// Compile one side of the filters from its patterns and, for includes,
+// the --ext extensions (with or without their dot). Returns false if out
+// of memory; the set can still be freed.
+static bool compile_filter_set(FilterSet *set, char **patterns, char **extensions) {
+    size_t n = count_names((const char *const *)patterns) +
+               count_names((const char *const *)extensions);
+    set->active = n > 0;
+    if (n == 0) {
+        return true;
+    }
+    set->globs = (FilterGlob *)calloc(n, sizeof(FilterGlob));
+    if (!set->globs || !alloc_name_set(&set->names, n) || !alloc_name_set(&set->extensions, n)) {
+        return false;
+    }
     
-    // Check custom skiplist if provided
-    if (config->custom_skip_dirs) {
-        for (int i = 0; config->custom_skip_dirs[i] != NULL; i++) {
-            if (strcmp(name, config->custom_skip_dirs[i]) == 0) {
-                return true;
+    for (size_t i = 0; extensions && extensions[i]; i++) {
+        add_name(&set->extensions, extensions[i] + (extensions[i][0] == '.'));
+        set->any_unanchored = true;
+    }
+    for (size_t i = 0; patterns && patterns[i]; i++) {
+        const char *text = patterns[i];
+        size_t start;
+        size_t n = strlen(text);
+        uint32_t flags = strip_pattern_slashes(text, &start, &n);
+        uint32_t len = (uint32_t)n;
+        
+        if (n == 0) {
+            // Only slashes: like an empty line in an ignore file, matches nothing
+            continue;
+        }
+        if (flags == 0 && is_literal_pattern(text, len)) {
+            add_name(&set->names, text);
+            set->any_unanchored = true;
+        } else if (flags == 0 && text[0] == '*' && text[1] == '.' &&
+                   is_literal_pattern(text + 1, len - 1)) {
+            add_name(&set->extensions, text + 2);
+            set->any_unanchored = true;
+        } else {
+            FilterGlob *glob = &set->globs[set->glob_count++];
+            glob->anchored = (flags & IGNORE_ANCHORED) != 0;
+            glob->dir_only = (flags & IGNORE_DIR_ONLY) != 0;
+            glob->text = text + start;
+            if (glob->dir_only) {
+                if (!(glob->copy = (char *)malloc(n + 1))) {
+                    return false;
+                }
+                memcpy(glob->copy, text + start, n);
+                glob->copy[n] = '\0';
+                glob->text = glob->copy;
+            }
+            if (glob->anchored && !(glob->components = split_glob_components(glob->text))) {
+                return false;
             }
+            set->any_unanchored |= !glob->anchored;
+            set->any_dir_only |= glob->dir_only;
         }
     }
+    return true;
+}
+
+// Free a compiled filter set
+static void free_filter_set(FilterSet *set) {
+    for (size_t i = 0; i < set->glob_count; i++) {
+        free(set->globs[i].components);
+        free(set->globs[i].copy);
+    }
+    free(set->globs);
+    free(set->names.slots);
+    free(set->extensions.slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// Compile the skip lists and filters of a configuration. The names are
+// borrowed, so the configuration must outlive the matcher. Returns false
+// if out of memory; the matcher can still be freed.
+static bool compile_skip_matcher(SkipMatcher *skip, const DirtreeConfig *config) {
+    memset(skip, 0, sizeof(*skip));
+    skip->enabled = config->skip_common;
+    skip->skip_hidden = config->skip_hidden;
     
-    // Check for hidden files/dirs if skip_hidden is enabled
-    if (config->skip_hidden && name[0] == '.') {
+    // The filters apply with or without the skip lists
+    if (!compile_filter_set(&skip->include, config->include_patterns, config->include_extensions) ||
+        !compile_filter_set(&skip->exclude, config->exclude_patterns, NULL)) {
+        return false;
+    }
+    skip->prune_dirs = skip->include.active && !skip->include.any_unanchored;
+    // Files are included below a directory-only include's matches, found
+    // on their paths
+    skip->needs_paths = skip->include.any_dir_only;
+    for (size_t i = 0; i < skip->include.glob_count; i++) {
+        skip->needs_paths |= skip->include.globs[i].anchored;
+    }
+    for (size_t i = 0; i < skip->exclude.glob_count; i++) {
+        skip->needs_paths |= skip->exclude.globs[i].anchored;
+    }
+    if (!skip->enabled) {
         return true;
     }
     
-    return false;
+    return compile_name_set(&skip->dirs, default_skiplist,
+                            (const char *const *)config->custom_skip_dirs) &&
+           compile_name_set(&skip->files, default_skipfiles,
+                            (const char *const *)config->custom_skip_files);
 }
 
-// Check if a file should be skipped
-static bool should_skip_file(const char *name, const DirtreeConfig *config) {
+// Free a compiled skip matcher
+static void free_skip_matcher(SkipMatcher *skip) {
+    free(skip->dirs.slots);
+    free(skip->files.slots);
+    skip->dirs.slots = NULL;
+    skip->files.slots = NULL;
+    free_filter_set(&skip->include);
+    free_filter_set(&skip->exclude);
+}
+
+// Check if a directory should be skipped
+static bool should_skip_dir(const char *name, const SkipMatcher *skip) {
     // If skipping is disabled, return false
-    if (!config->skip_common) {
+    if (!skip->enabled) {
         return false;
     }
     
-    // Check default skipfiles
-    for (int i = 0; default_skipfiles[i] != NULL; i++) {
-        if (strcmp(name, default_skipfiles[i]) == 0) {
-            return true;
-        }
+    // Check for hidden files/dirs if skip_hidden is enabled
+    if (skip->skip_hidden && name[0] == '.') {
+        return true;
     }
     
-    // Check custom skipfiles if provided
-    if (config->custom_skip_files) {
-        for (int i = 0; config->custom_skip_files[i] != NULL; i++) {
-            if (strcmp(name, config->custom_skip_files[i]) == 0) {
-                return true;
-            }
-        }
+    // Check the default and custom skiplists
+    return name_set_contains(&skip->dirs, name);
+}
+
+// Check if a file should be skipped
+static bool should_skip_file(const char *name, const SkipMatcher *skip) {
+    // If skipping is disabled, return false
+    if (!skip->enabled) {
+        return false;
     }
     
     // Check for hidden files if skip_hidden is enabled
-    if (config->skip_hidden && name[0] == '.') {
+    if (skip->skip_hidden && name[0] == '.') {
         return true;
     }
     
-    return false;
+    // Check the default and custom skipfiles
+    return name_set_contains(&skip->files, name);
 }
 
-// Helper for string buffer handling
-typedef struct {
-    char *buffer;
-    size_t size;
-    size_t capacity;
-} StringBuffer;
+// Check whether what follows any dot of a name is in the set, so that
+// "a.tar.gz" is found by "tar.gz" as well as by "gz"
+static bool has_listed_extension(const NameSet *extensions, const char *name) {
+    for (const char *dot = strchr(name, '.'); dot; dot = strchr(dot + 1, '.')) {
+        if (name_set_contains(extensions, dot + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-// Initialize string buffer
-static void init_string_buffer(StringBuffer *sb, size_t initial_capacity) {
-    sb->buffer = (char *)malloc(initial_capacity);
-    if (!sb->buffer) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+// Check whether an entry matches any pattern of a filter set. path is
+// its path below the root, needed by anchored patterns.
+static bool filter_set_matches(const FilterSet *set, const char *name, const char *path,
+                               bool is_dir) {
+    if (name_set_contains(&set->names, name) || has_listed_extension(&set->extensions, name)) {
+        return true;
     }
-    sb->buffer[0] = '\0';
-    sb->size = 0;
-    sb->capacity = initial_capacity;
+    for (size_t i = 0; i < set->glob_count; i++) {
+        const FilterGlob *glob = &set->globs[i];
+        if ((is_dir || !glob->dir_only) &&
+            glob_match(glob->text, glob->text, glob->anchored ? path : name)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-// Append to string buffer
-static void string_buffer_append(StringBuffer *sb, const char *str) {
-    size_t len = strlen(str);
-    size_t new_size = sb->size + len + 1;  // +1 for null terminator
-    
-    if (new_size > sb->capacity) {
-        size_t new_capacity = sb->capacity * 2;
-        while (new_capacity < new_size) {
-            new_capacity *= 2;
+// Check whether a directory above the file at path (below the root)
+// matches a directory-only pattern of a set. path is restored before
+// returning.
+static bool filter_set_matches_above(const FilterSet *set, char *path) {
+    const char *name = path;
+    for (char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        bool matched = false;
+        for (size_t i = 0; i < set->glob_count && !matched; i++) {
+            const FilterGlob *glob = &set->globs[i];
+            matched = glob->dir_only &&
+                      glob_match(glob->text, glob->text, glob->anchored ? path : name);
         }
-        
-        sb->buffer = (char *)realloc(sb->buffer, new_capacity);
-        if (!sb->buffer) {
-            perror("Memory reallocation failed");
-            exit(EXIT_FAILURE);
+        *slash = '/';
+        if (matched) {
+            return true;
         }
-        sb->capacity = new_capacity;
+        name = slash + 1;
     }
-    
-    strcat(sb->buffer + sb->size, str);
-    sb->size += len;
+    return false;
 }
 
-// Free string buffer
-static char *string_buffer_release(StringBuffer *sb) {
-    char *result = sb->buffer;
-    sb->buffer = NULL;
-    sb->size = 0;
-    sb->capacity = 0;
-    return result;
+// Check whether an anchored pattern could match something below the
+// directory at path: each component of path must match the pattern's
+// component at the same depth and the pattern must go on past them,
+// unless a "**" component comes first. A directory-only pattern also
+// reaches what is below its own match. path is restored before returning.
+static bool glob_may_match_below(const FilterGlob *glob, char *path) {
+    char **component = glob->components;
+    for (char *start = path; *component; component++) {
+        if (strcmp(*component, "**") == 0) {
+            return true;
+        }
+        char *end = strchr(start, '/');
+        if (end) {
+            *end = '\0';
+        }
+        bool matched = glob_match(*component, *component, start);
+        if (end) {
+            *end = '/';
+        }
+        if (!matched) {
+            return false;
+        }
+        if (!end) {
+            return component[1] != NULL || glob->dir_only;
+        }
+        start = end + 1;
+    }
+    return glob->dir_only;
 }
 
-// Print tree to string buffer
-static void print_tree_to_buffer(StringBuffer *sb, const char *dir, const char *prefix, 
-                                const DirtreeConfig *config, int current_depth, 
-                                VisitedDirs *visited) {
-    // Check if we've reached the maximum depth
-    if (config->max_depth > 0 && current_depth > config->max_depth) {
-        return;
+// Check whether the --include, --exclude and --ext filters leave out an
+// entry. path is its path below the root when skip->needs_paths, else
+// NULL. Directories are only left out by includes when every include is
+// anchored and none can match below them, so they are never opened.
+static bool filters_reject(const SkipMatcher *skip, const char *name, char *path, bool is_dir) {
+    if (skip->exclude.active && filter_set_matches(&skip->exclude, name, path, is_dir)) {
+        return true;
     }
-    
-    // Skip the directory if it has already been visited
-    if (is_visited(visited, dir)) {
-        return;
+    if (!skip->include.active) {
+        return false;
     }
-    mark_visited(visited, dir);
-    
-#ifdef _WIN32
-    WIN32_FIND_DATA findData;
-    char search_path[PATH_MAX];
-    snprintf(search_path, PATH_MAX, "%s\\*", dir);
-    
-    HANDLE hFind = FindFirstFile(search_path, &findData);
-    if (hFind == INVALID_HANDLE_VALUE) {
-        return;
+    if (!is_dir) {
+        return !filter_set_matches(&skip->include, name, path, false) &&
+               !(skip->include.any_dir_only && filter_set_matches_above(&skip->include, path));
     }
-    
-    // Count and collect entries
+    if (!skip->prune_dirs) {
+        return false;
+    }
+    for (size_t i = 0; i < skip->include.glob_count; i++) {
+        if (glob_may_match_below(&skip->include.globs[i], path)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Ignore files read while walking: each directory holding a .gitignore or
+// .ignore adds a layer of compiled patterns over its parent's. Patterns
+// without wildcards are found by one hash lookup on the name, "*.ext"
+// style ones by a lookup on the name's extension, and only the rest go
+// through glob_match.
+
+// Largest ignore file read; anything longer is cut off
+#define IGNORE_FILE_MAX (1024 * 1024)
+
+typedef struct {
+    const char *text;            // Without '!', a leading '/' or the trailing '/'
+    uint32_t len;
+    uint32_t flags;              // IGNORE_*
+    int next;                    // Previous suffix pattern with the same extension, or -1
+} IgnorePattern;
+
+// Slot of a layer's literal or extension table; key is NULL when empty
+typedef struct {
+    const char *key;
+    uint32_t hash;
+    uint32_t len;
+    int last;                    // Last pattern with this key (for directories too)
+    int last_file;               // Literals: last one that also applies to files
+} IgnoreSlot;
+
+typedef struct IgnoreLayer {
+    const struct IgnoreLayer *parent;
+    size_t base_len;             // Length of the layer directory's path below the root
+    bool anchored;               // This layer or one further out has anchored patterns
+    IgnorePattern *patterns;     // In file order; the last match decides
+    int count;
+    IgnoreSlot *literals;        // Plain names
+    IgnoreSlot *suffixes;        // "*<text>.ext", keyed by ext
+    size_t table_capacity;       // Power of two, for both tables
+    int *globs;                  // Every other pattern, in order
+    int glob_count;
+} IgnoreLayer;
+
+// Where a directory stands for the ignore rules and the anchored filters
+typedef struct IgnoreScope {
+    const IgnoreLayer *layer;    // Innermost layer in force, NULL if none
+    const char *path;            // Path below the root, "" for the root itself
+    size_t path_len;
+} IgnoreScope;
+
+// Find the slot of key in a layer table, or the empty slot where it belongs
+static IgnoreSlot *find_ignore_slot(IgnoreSlot *table, size_t capacity, const char *key,
+                                    uint32_t len, uint32_t hash) {
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+    while (table[i].key) {
+        if (table[i].hash == hash && table[i].len == len && memcmp(table[i].key, key, len) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+// FNV-1a hash of a counted string
+static uint32_t hash_bytes(const char *key, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Check whether one pattern matches an entry. path is the entry's path
+// below the layer's directory.
+static bool ignore_pattern_matches(const IgnorePattern *pattern, const char *name, const char *path,
+                                   bool is_dir) {
+    if ((pattern->flags & IGNORE_DIR_ONLY) && !is_dir) {
+        return false;
+    }
+    const char *subject = (pattern->flags & IGNORE_ANCHORED) ? path : name;
+    return glob_match(pattern->text, pattern->text, subject);
+}
+
+// Index of the last pattern of a layer matching an entry, or -1
+static int match_ignore_layer(const IgnoreLayer *layer, const char *name, uint32_t name_len,
+                              const char *path, bool is_dir) {
+    int best = -1;
+    
+    if (layer->table_capacity > 0) {
+        uint32_t hash = hash_bytes(name, name_len);
+        const IgnoreSlot *slot = find_ignore_slot(layer->literals, layer->table_capacity, name,
+                                                  name_len, hash);
+        if (slot->key) {
+            best = is_dir ? slot->last : slot->last_file;
+        }
+        
+        // Suffix patterns sharing the name's extension, newest first
+        uint32_t ext_len;
+        const char *ext = name_extension(name, name_len, &ext_len);
+        if (ext) {
+            slot = find_ignore_slot(layer->suffixes, layer->table_capacity, ext, ext_len,
+                                    hash_bytes(ext, ext_len));
+            for (int i = slot->key ? slot->last : -1; i > best; i = layer->patterns[i].next) {
+                const IgnorePattern *pattern = &layer->patterns[i];
+                uint32_t tail = pattern->len - 1;  // Past the leading '*'
+                if ((!(pattern->flags & IGNORE_DIR_ONLY) || is_dir) && tail <= name_len &&
+                    memcmp(name + name_len - tail, pattern->text + 1, tail) == 0) {
+                    best = i;
+                    break;
+                }
+            }
+        }
+    }
+    
+    for (int g = layer->glob_count - 1; g >= 0 && layer->globs[g] > best; g--) {
+        if (ignore_pattern_matches(&layer->patterns[layer->globs[g]], name, path, is_dir)) {
+            best = layer->globs[g];
+            break;
+        }
+    }
+    return best;
+}
+
+// Decide whether the ignore files in force exclude an entry of the
+// directory at scope. The innermost layer with a matching pattern
+// decides, and within it the last such pattern. path holds the entry's
+// path below the root when a layer needs it, else NULL.
+static bool is_ignored(const IgnoreScope *scope, const char *name, uint32_t name_len,
+                       const char *path, bool is_dir) {
+    for (const IgnoreLayer *layer = scope->layer; layer; layer = layer->parent) {
+        const char *below = path ? path + layer->base_len + (layer->base_len > 0) : NULL;
+        int i = match_ignore_layer(layer, name, name_len, below, is_dir);
+        if (i >= 0) {
+            return !(layer->patterns[i].flags & IGNORE_NEGATE);
+        }
+    }
+    return false;
+}
+
+// Helper for string buffer handling. With an output stream attached the
+// buffer has a fixed capacity and is written out whenever it fills, so
+// memory stays flat however large the tree is.
+typedef struct {
+    char *buffer;
+    size_t size;
+    size_t capacity;
+    size_t flushed;              // Bytes already written to out
+    FILE *out;                   // Streaming destination, NULL to keep everything in memory
+    DirtreeErrorCode error;      // Set once growing or writing fails; later output is dropped
+    int sys_errno;
+} StringBuffer;
+
+// Initialize string buffer. Returns false if out of memory.
+static bool init_string_buffer(StringBuffer *sb, size_t initial_capacity) {
+    sb->buffer = (char *)malloc(initial_capacity);
+    sb->size = 0;
+    sb->capacity = initial_capacity;
+    sb->flushed = 0;
+    sb->out = NULL;
+    sb->error = DIRTREE_OK;
+    sb->sys_errno = 0;
+    if (!sb->buffer) {
+        sb->capacity = 0;
+        return false;
+    }
+    sb->buffer[0] = '\0';
+    return true;
+}
+
+// Initialize a string buffer that streams to out in chunks of capacity bytes
+static bool init_stream_buffer(StringBuffer *sb, FILE *out, size_t capacity) {
+    if (!init_string_buffer(sb, capacity)) {
+        return false;
+    }
+    sb->out = out;
+    return true;
+}
+
+// Write out everything buffered so far (streaming buffers only)
+static void string_buffer_flush(StringBuffer *sb) {
+    if (sb->error == DIRTREE_OK && sb->size > 0) {
+        if (fwrite(sb->buffer, 1, sb->size, sb->out) != sb->size) {
+            sb->error = DIRTREE_ERR_IO;
+            sb->sys_errno = errno;
+        } else {
+            sb->flushed += sb->size;
+        }
+    }
+    sb->size = 0;
+    sb->buffer[0] = '\0';
+}
+
+// Make room for len more bytes and return where they go. The caller
+// fills them in and then calls string_buffer_commit. Returns NULL once
+// the buffer has failed.
+static char *string_buffer_reserve(StringBuffer *sb, size_t len) {
+    size_t new_size = sb->size + len + 1;  // +1 for null terminator
+    
+    if (new_size > sb->capacity && sb->out) {
+        string_buffer_flush(sb);
+        new_size = len + 1;
+    }
+    if (sb->error != DIRTREE_OK) {
+        return NULL;
+    }
+    
+    if (new_size > sb->capacity) {
+        size_t new_capacity = sb->capacity * 2;
+        while (new_capacity < new_size) {
+            new_capacity *= 2;
+        }
+        
+        char *buffer = (char *)realloc(sb->buffer, new_capacity);
+        if (!buffer) {
+            sb->error = DIRTREE_ERR_NOMEM;
+            sb->sys_errno = ENOMEM;
+            return NULL;
+        }
+        sb->buffer = buffer;
+        sb->capacity = new_capacity;
+    }
+    
+    return sb->buffer + sb->size;
+}
+
+// Account for len bytes written after string_buffer_reserve
+static void string_buffer_commit(StringBuffer *sb, size_t len) {
+    sb->size += len;
+    sb->buffer[sb->size] = '\0';
+}
+
+// Free string buffer
+static char *string_buffer_release(StringBuffer *sb) {
+    char *result = sb->buffer;
+    sb->buffer = NULL;
+    sb->size = 0;
+    sb->capacity = 0;
+    return result;
+}
+
+// Bump allocator for traversal-scoped storage: entry names and listings
+// are carved out of large blocks and given back all at once, either when
+// the walk ends or, since the walk is depth-first, by releasing to a mark
+// taken before a directory was listed
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *current;
+    ArenaBlock *spare;           // Last released block, kept to avoid malloc churn at a block edge
+} Arena;
+
+// Position in an arena to release back to
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+// Default arena block size; larger requests get a block of their own size
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Initialize an empty arena
+static void init_arena(Arena *arena) {
+    arena->current = NULL;
+    arena->spare = NULL;
+}
+
+// Allocate size bytes aligned for any entry field. Returns NULL if out of memory.
+static void *arena_alloc(Arena *arena, size_t size) {
+    const size_t align = sizeof(void *);
+    ArenaBlock *block = arena->current;
+    size_t offset = block ? (block->used + align - 1) & ~(align - 1) : 0;
+    
+    if (!block || offset + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        if (arena->spare && arena->spare->size >= block_size) {
+            block = arena->spare;
+            arena->spare = NULL;
+        } else {
+            block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + block_size);
+            if (!block) {
+                return NULL;
+            }
+            block->size = block_size;
+        }
+        block->prev = arena->current;
+        block->used = 0;
+        arena->current = block;
+        offset = 0;
+    }
+    
+    block->used = offset + size;
+    return block->data + offset;
+}
+
+// Copy a string of known length into the arena
+static char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = (char *)arena_alloc(arena, len + 1);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Remember the current top of the arena
+static ArenaMark arena_mark(const Arena *arena) {
+    ArenaMark mark = { arena->current, arena->current ? arena->current->used : 0 };
+    return mark;
+}
+
+// Give back everything allocated since mark was taken
+static void arena_release(Arena *arena, ArenaMark mark) {
+    while (arena->current != mark.block) {
+        ArenaBlock *block = arena->current;
+        arena->current = block->prev;
+        if (!arena->spare) {
+            arena->spare = block;
+        } else if (block->size > arena->spare->size) {
+            free(arena->spare);
+            arena->spare = block;
+        } else {
+            free(block);
+        }
+    }
+    if (arena->current) {
+        arena->current->used = mark.used;
+    }
+}
+
+// Free every block of an arena
+static void free_arena(Arena *arena) {
+    ArenaMark empty = { NULL, 0 };
+    arena_release(arena, empty);
+    free(arena->spare);
+    arena->spare = NULL;
+}
+
+// State shared by every level of one traversal
+typedef struct {
+    const DirtreeConfig *config;
+    const SkipMatcher *skip;     // Compiled skip lists, shared by every walker
+    StringBuffer *sb;            // Text output, NULL when entries go to visitor
+    DirtreeVisitor visitor;
+    void *userdata;
+    char *prefix;                // Connectors of the current branch, one segment per level
+    size_t prefix_len;
+    size_t prefix_capacity;
+    Arena arena;                 // Names and listings of the directories being walked
+    DirEntry *scratch;           // Reused while a directory is read, sized to the widest one
+    int scratch_capacity;
+    VisitedDirs visited;         // Every directory entered (DIRTREE_CYCLES_VISITED)
+    VisitedDirs empty_dirs;      // Those prune_empty left out, so repeats are left out too
+    AncestorStack ancestors;     // Current branch only (DIRTREE_CYCLES_ANCESTORS)
+    struct HeldDir *held_dirs;   // Descriptors of the directories being walked, by slot
+    int held_count;              // Slots up to the last one in use
+    int held_capacity;
+    int held_open;               // Slots whose descriptor is open
+    int held_cap;                // Most kept open at once, well under RLIMIT_NOFILE
+    unsigned long held_clock;    // Ticks at each (re)open, so the oldest is closed first
+    char *root_path;             // Absolute root, to reopen directories closed for held_cap
+    char *dirent_buf;            // getdents64 buffer, NULL when readdir is used
+    size_t dirent_buf_size;
+    struct StatRing *ring;       // io_uring statx batching, NULL for synchronous stat
+    DirtreeStats *stats;         // Counters for this walker, NULL when not collected
+    const DirtreeIndex *index;   // Snapshot walked instead of the disk, NULL to scan
+    const DirtreeIndex *baseline; // Earlier snapshot of this tree vouching for unchanged directories
+    int64_t baseline_trusted;    // Directories stamped at or after this are re-read anyway
+    const VisitedDirs *settled;  // Baseline directories a watch saw no change in, listed unopened
+    bool use_ignore_files;       // Apply .gitignore and .ignore files (never to a snapshot)
+    unsigned ignore_found;       // IGNORE_FOUND_* of the directory being read
+    bool links_dropped;          // The directory being read left out symlinks for their targets
+    const struct IgnoreScope *scope; // Scope of the directory being listed
+    char *entry_path;            // Entry paths for anchored ignore and filter patterns
+    size_t entry_path_capacity;
+    int child_cap;               // Entries listed per directory in the text (0 = all)
+    bool budgeted;               // The text has an entry, size or time budget
+    unsigned long entries_left;  // Lines max_entries still allows
+    int64_t deadline;            // monotonic_ns() at which max_time_ms runs out (0 = none)
+    int clock_countdown;         // Budget checks left until the clock is read again
+    const char *truncated;       // Marker of the budget that ran out, NULL while within them
+    DirtreeError error;          // First failure, which unwinds the walk, and unreadable dirs
+} TreeWalk;
+
+// Truncation markers, printed in place of the first line past a budget
+#define TRUNCATED_ENTRIES "... (truncated: entry limit reached)"
+#define TRUNCATED_BYTES "... (truncated: output limit reached)"
+#define TRUNCATED_TIME "... (truncated: time limit reached)"
+#define TRUNCATED_MAX_LEN (sizeof(TRUNCATED_BYTES) - 1)
+
+// Entries between two reads of the clock for max_time_ms
+#define DEADLINE_CHECK_INTERVAL 64
+
+// Monotonic clock in nanoseconds, for debouncing and time budgets
+static int64_t monotonic_ns(void) {
+#ifdef _WIN32
+    return (int64_t)GetTickCount64() * 1000000;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Check whether the walk has run out of a budget, reading the clock for
+// the time budget only every few calls
+static bool budget_spent(TreeWalk *walk) {
+    if (walk->deadline != 0 && !walk->truncated && --walk->clock_countdown <= 0) {
+        walk->clock_countdown = DEADLINE_CHECK_INTERVAL;
+        if (monotonic_ns() >= walk->deadline) {
+            walk->truncated = TRUNCATED_TIME;
+        }
+    }
+    return walk->truncated != NULL;
+}
+
+// Check whether the walk has failed and must unwind
+static bool walk_failed(const TreeWalk *walk) {
+    return walk->error.code != DIRTREE_OK;
+}
+
+// Fail the walk because an allocation failed
+static void walk_out_of_memory(TreeWalk *walk) {
+    record_error(&walk->error, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
+}
+
+// Check whether an open failed for want of file descriptors
+static bool out_of_descriptors(int sys_errno) {
+    return sys_errno == EMFILE || sys_errno == ENFILE;
+}
+
+// Count a directory that could not be opened or listed; the walk goes on.
+// Running out of descriptors says nothing about the directory, so that
+// fails the walk instead of quietly leaving the directory out.
+static void note_unreadable(TreeWalk *walk, int sys_errno, const char *name) {
+    if (out_of_descriptors(sys_errno)) {
+        record_error(&walk->error, DIRTREE_ERR_IO, sys_errno, name);
+        return;
+    }
+    walk->error.dirs_unreadable++;
+    record_error(&walk->error, DIRTREE_OK, sys_errno, name);
+}
+
+// Hand the walk's report to the caller, if one was asked for
+static void report_error(const TreeWalk *walk) {
+    if (walk->config->error) {
+        *walk->config->error = walk->error;
+    }
+}
+
+// Slot n of the walker's scratch listing, growing it as needed. Returns
+// NULL, failing the walk, if out of memory.
+static DirEntry *scratch_entry(TreeWalk *walk, int n) {
+    if (n >= walk->scratch_capacity) {
+        int capacity = walk->scratch_capacity ? walk->scratch_capacity * 2 : 64;
+        DirEntry *scratch = (DirEntry *)realloc(walk->scratch, capacity * sizeof(DirEntry));
+        if (!scratch) {
+            walk_out_of_memory(walk);
+            return NULL;
+        }
+        walk->scratch = scratch;
+        walk->scratch_capacity = capacity;
+    }
+    return &walk->scratch[n];
+}
+
+// Move the first count scratch entries into the arena as the directory's
+// listing. Returns NULL, failing the walk, if out of memory.
+static DirEntry *commit_entries(TreeWalk *walk, int count) {
+    DirEntry *items = (DirEntry *)arena_alloc(&walk->arena, count * sizeof(DirEntry));
+    if (!items) {
+        walk_out_of_memory(walk);
+        return NULL;
+    }
+    if (count > 0) {
+        memcpy(items, walk->scratch, count * sizeof(DirEntry));
+    }
+    return items;
+}
+
+// Bits of TreeWalk.ignore_found, in the order the files are applied
+#define IGNORE_FOUND_GITIGNORE 0x01
+#define IGNORE_FOUND_IGNORE 0x02
+
+// The IGNORE_FOUND_* bit of an ignore file's name, 0 for other names
+static unsigned ignore_file_kind(const char *name) {
+    if (name[0] != '.') {
+        return 0;
+    }
+    if (strcmp(name, ".gitignore") == 0) {
+        return IGNORE_FOUND_GITIGNORE;
+    }
+    return strcmp(name, ".ignore") == 0 ? IGNORE_FOUND_IGNORE : 0;
+}
+
+// Note an ignore file among the names of the directory being read, so
+// only directories that hold one pay for opening it
+static void note_ignore_file(TreeWalk *walk, const char *name) {
+    if (walk->use_ignore_files) {
+        walk->ignore_found |= ignore_file_kind(name);
+    }
+}
+
+#ifndef _WIN32
+static bool close_oldest_held_dir(TreeWalk *walk, int keep);
+#endif
+
+// Read the ignore file name of the directory open as dir_fd (at dir_path
+// on Windows) into the arena, NUL-terminated, and store its length in len.
+// Returns NULL if it can't be read, which only leaves its patterns out, or
+// if out of memory or descriptors, which fails the walk.
+static char *read_ignore_file(TreeWalk *walk, int dir_fd, const char *dir_path, const char *name,
+                              size_t *len) {
+    char *text = NULL;
+    size_t size = 0;
+#ifdef _WIN32
+    (void)dir_fd;
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s\\%s", dir_path, name);
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    long end;
+    if (fseek(file, 0, SEEK_END) == 0 && (end = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        size = end > IGNORE_FILE_MAX ? IGNORE_FILE_MAX : (size_t)end;
+        text = (char *)arena_alloc(&walk->arena, size + 1);
+        if (text) {
+            size = fread(text, 1, size, file);
+        }
+    }
+    fclose(file);
+#else
+    (void)dir_path;
+    // Non-blocking, so a FIFO by that name can't stall the walk
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    while (fd < 0 && out_of_descriptors(errno) && close_oldest_held_dir(walk, -1)) {
+        fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    }
+    if (fd < 0) {
+        if (out_of_descriptors(errno)) {
+            record_error(&walk->error, DIRTREE_ERR_IO, errno, name);
+        }
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        size = st.st_size > IGNORE_FILE_MAX ? IGNORE_FILE_MAX : (size_t)st.st_size;
+        text = (char *)arena_alloc(&walk->arena, size + 1);
+        size_t got = 0;
+        while (text && got < size) {
+            ssize_t n = read(fd, text + got, size - got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            got += (size_t)n;
+        }
+        size = got;
+    }
+    close(fd);
+#endif
+    if (size > 0 && !text) {
+        walk_out_of_memory(walk);
+        return NULL;
+    }
+    if (text) {
+        text[size] = '\0';
+    }
+    *len = size;
+    return text;
+}
+
+// Parse the lines of an ignore file in place, appending its patterns to
+// the count already in patterns (which has room for one per line).
+// Returns the new count.
+static int parse_ignore_lines(char *text, size_t len, IgnorePattern *patterns, int count) {
+    char *end = text + len;
+    for (char *line = text; line < end; ) {
+        char *eol = (char *)memchr(line, '\n', (size_t)(end - line));
+        if (!eol) {
+            eol = end;
+        }
+        char *next = eol < end ? eol + 1 : end;
+        size_t n = (size_t)(eol - line);
+        uint32_t flags = 0;
+        
+        if (n > 0 && line[n - 1] == '\r') {
+            n--;
+        }
+        // Trailing spaces go unless quoted with '\'
+        while (n > 0 && line[n - 1] == ' ' && !(n > 1 && line[n - 2] == '\\')) {
+            n--;
+        }
+        if (n > 0 && line[0] == '#') {
+            n = 0;
+        } else if (n > 0 && line[0] == '!') {
+            flags |= IGNORE_NEGATE;
+            line++;
+            n--;
+        } else if (n > 1 && line[0] == '\\' && (line[1] == '!' || line[1] == '#')) {
+            line++;
+            n--;
+        }
+        size_t start;
+        flags |= strip_pattern_slashes(line, &start, &n);
+        line += start;
+        
+        if (n > 0) {
+            line[n] = '\0';
+            IgnorePattern *pattern = &patterns[count++];
+            pattern->text = line;
+            pattern->len = (uint32_t)n;
+            pattern->flags = flags;
+            pattern->next = -1;
+        }
+        line = next;
+    }
+    return count;
+}
+
+// Claim the slot of key in a layer table
+static IgnoreSlot *claim_ignore_slot(IgnoreSlot *table, size_t capacity, const char *key,
+                                     uint32_t len) {
+    uint32_t hash = hash_bytes(key, len);
+    IgnoreSlot *slot = find_ignore_slot(table, capacity, key, len, hash);
+    if (!slot->key) {
+        slot->key = key;
+        slot->hash = hash;
+        slot->len = len;
+        slot->last = -1;
+        slot->last_file = -1;
+    }
+    return slot;
+}
+
+// Compile the ignore files of a directory just read (open as dir_fd, at
+// dir_path on Windows) into a layer over scope's, .ignore after .gitignore
+// so its patterns win. scope is left alone when they hold no patterns.
+// Returns false, failing the walk, if out of memory or descriptors.
+static bool push_ignore_layer(TreeWalk *walk, int dir_fd, const char *dir_path, IgnoreScope *scope) {
+    static const char *const names[2] = { ".gitignore", ".ignore" };
+    char *texts[2] = { NULL, NULL };
+    size_t lens[2] = { 0, 0 };
+    size_t lines = 0;
+    
+    for (int f = 0; f < 2; f++) {
+        if (!(walk->ignore_found & (1u << f))) {
+            continue;
+        }
+        texts[f] = read_ignore_file(walk, dir_fd, dir_path, names[f], &lens[f]);
+        if (walk_failed(walk)) {
+            return false;
+        }
+        if (texts[f]) {
+            lines++;
+            for (const char *c = texts[f]; (c = memchr(c, '\n', lens[f] - (size_t)(c - texts[f]))); c++) {
+                lines++;
+            }
+        }
+    }
+    if (lines == 0) {
+        return true;
+    }
+    
+    Arena *arena = &walk->arena;
+    IgnoreLayer *layer = (IgnoreLayer *)arena_alloc(arena, sizeof(IgnoreLayer));
+    IgnorePattern *patterns = (IgnorePattern *)arena_alloc(arena, lines * sizeof(IgnorePattern));
+    int *globs = (int *)arena_alloc(arena, lines * sizeof(int));
+    if (!layer || !patterns || !globs) {
+        walk_out_of_memory(walk);
+        return false;
+    }
+    int count = 0;
+    for (int f = 0; f < 2; f++) {
+        if (texts[f]) {
+            count = parse_ignore_lines(texts[f], lens[f], patterns, count);
+        }
+    }
+    if (count == 0) {
+        return true;
+    }
+    
+    size_t capacity = 8;
+    while (capacity < 2 * (size_t)count) {
+        capacity *= 2;
+    }
+    IgnoreSlot *tables = (IgnoreSlot *)arena_alloc(arena, 2 * capacity * sizeof(IgnoreSlot));
+    if (!tables) {
+        walk_out_of_memory(walk);
+        return false;
+    }
+    memset(tables, 0, 2 * capacity * sizeof(IgnoreSlot));
+    layer->parent = scope->layer;
+    layer->base_len = scope->path_len;
+    layer->anchored = scope->layer && scope->layer->anchored;
+    layer->patterns = patterns;
+    layer->count = count;
+    layer->literals = tables;
+    layer->suffixes = tables + capacity;
+    layer->table_capacity = capacity;
+    layer->globs = globs;
+    layer->glob_count = 0;
+    
+    for (int i = 0; i < count; i++) {
+        IgnorePattern *pattern = &patterns[i];
+        uint32_t ext_len = 0;
+        const char *ext = NULL;
+        
+        if (pattern->flags & IGNORE_ANCHORED) {
+            layer->anchored = true;
+        } else if (is_literal_pattern(pattern->text, pattern->len)) {
+            IgnoreSlot *slot = claim_ignore_slot(layer->literals, capacity, pattern->text, pattern->len);
+            slot->last = i;
+            if (!(pattern->flags & IGNORE_DIR_ONLY)) {
+                slot->last_file = i;
+            }
+            continue;
+        } else if (pattern->text[0] == '*' && is_literal_pattern(pattern->text + 1, pattern->len - 1) &&
+                   (ext = name_extension(pattern->text + 1, pattern->len - 1, &ext_len)) &&
+                   ext_len > 0) {
+            IgnoreSlot *slot = claim_ignore_slot(layer->suffixes, capacity, ext, ext_len);
+            pattern->next = slot->last;
+            slot->last = i;
+            continue;
+        }
+        globs[layer->glob_count++] = i;
+    }
+    scope->layer = layer;
+    return true;
+}
+
+// Set up the ignore scope of the directory name inside the one at outer
+// (NULL for the root); its own ignore files are added once it is read.
+// The path below the root is kept even without ignore files or anchored
+// filters, for error reports. Returns false, failing the walk, if out of
+// memory.
+static bool enter_ignore_scope(TreeWalk *walk, const IgnoreScope *outer, const char *name,
+                               IgnoreScope *scope) {
+    scope->layer = outer ? outer->layer : NULL;
+    scope->path = "";
+    scope->path_len = 0;
+    if (!outer) {
+        return true;
+    }
+    
+    size_t name_len = strlen(name);
+    size_t len = outer->path_len + (outer->path_len > 0) + name_len;
+    char *path = (char *)arena_alloc(&walk->arena, len + 1);
+    if (!path) {
+        walk_out_of_memory(walk);
+        return false;
+    }
+    if (outer->path_len > 0) {
+        memcpy(path, outer->path, outer->path_len);
+        path[outer->path_len] = '/';
+    }
+    memcpy(path + len - name_len, name, name_len + 1);
+    scope->path = path;
+    scope->path_len = len;
+    return true;
+}
+
+// Build the path below the root of the entry name of the directory at
+// scope in the walk's buffer. Returns NULL, failing the walk, if out of
+// memory.
+static char *build_entry_path(TreeWalk *walk, const IgnoreScope *scope, const char *name,
+                              size_t name_len) {
+    size_t len = scope->path_len + (scope->path_len > 0) + name_len;
+    if (len + 1 > walk->entry_path_capacity) {
+        size_t capacity = walk->entry_path_capacity ? walk->entry_path_capacity : 256;
+        while (capacity < len + 1) {
+            capacity *= 2;
+        }
+        char *grown = (char *)realloc(walk->entry_path, capacity);
+        if (!grown) {
+            walk_out_of_memory(walk);
+            return NULL;
+        }
+        walk->entry_path = grown;
+        walk->entry_path_capacity = capacity;
+    }
+    if (scope->path_len > 0) {
+        memcpy(walk->entry_path, scope->path, scope->path_len);
+        walk->entry_path[scope->path_len] = '/';
+    }
+    memcpy(walk->entry_path + len - name_len, name, name_len);
+    walk->entry_path[len] = '\0';
+    return walk->entry_path;
+}
+
+// Count a directory that could not be read, reported by its path below
+// the root; dir names it when it is the root itself
+static void note_unreadable_scope(TreeWalk *walk, int sys_errno, const IgnoreScope *scope,
+                                  const char *dir) {
+    note_unreadable(walk, sys_errno, scope->path_len > 0 ? scope->path : dir);
+}
+
+// Count the subdirectory name of the directory at scope as unreadable,
+// reported by its path below the root
+static void note_unreadable_child(TreeWalk *walk, int sys_errno, const IgnoreScope *scope,
+                                  const char *name) {
+    const char *path = build_entry_path(walk, scope, name, strlen(name));
+    note_unreadable(walk, sys_errno, path ? path : name);
+}
+
+// Check whether the skip rules or the filters leave out an entry of the
+// directory being listed (walk->scope). An entry whose path can't be
+// built for want of memory is left out, failing the walk.
+static bool skips_entry(TreeWalk *walk, const char *name, size_t name_len, bool is_dir) {
+    const SkipMatcher *skip = walk->skip;
+    if (is_dir ? should_skip_dir(name, skip) : should_skip_file(name, skip)) {
+        return true;
+    }
+    if (!skip->include.active && !skip->exclude.active) {
+        return false;
+    }
+    char *path = NULL;
+    if (skip->needs_paths && !(path = build_entry_path(walk, walk->scope, name, name_len))) {
+        return true;
+    }
+    return filters_reject(skip, name, path, is_dir);
+}
+
+// Drop the entries of a listing excluded by the ignore layers in force
+// at scope. Returns false, failing the walk, if out of memory.
+static bool filter_ignored(TreeWalk *walk, const IgnoreScope *scope, DirEntry *items, int *count) {
+    if (!walk->use_ignore_files || !scope->layer) {
+        return true;
+    }
+    
+    int kept = 0;
+    for (int i = 0; i < *count; i++) {
+        DirEntry *item = &items[i];
+        const char *path = NULL;
+        
+        // Anchored patterns need the entry's path below the root
+        if (scope->layer->anchored &&
+            !(path = build_entry_path(walk, scope, item->name, item->name_len))) {
+            return false;
+        }
+        if (!is_ignored(scope, item->name, item->name_len, path, item->is_dir)) {
+            items[kept++] = *item;
+        }
+    }
+    *count = kept;
+    return true;
+}
+
+// Apply the ignore files of a directory just read: add their layer to
+// scope, then drop the entries of the listing excluded by the layers in
+// force. Returns false, failing the walk, if out of memory.
+static bool apply_ignore_files(TreeWalk *walk, int dir_fd, const char *dir_path, IgnoreScope *scope,
+                               DirEntry *items, int *count) {
+    if (!walk->use_ignore_files) {
+        return true;
+    }
+    if (walk->ignore_found && !push_ignore_layer(walk, dir_fd, dir_path, scope)) {
+        return false;
+    }
+    return filter_ignored(walk, scope, items, count);
+}
+
+// Exchange two entries of a listing
+static void swap_entries(DirEntry *a, DirEntry *b) {
+    DirEntry swap = *a;
+    *a = *b;
+    *b = swap;
+}
+
+// Move the k smallest of count entries (0 < k <= count) to the front, in
+// order, leaving the others unsorted behind them: a quickselect on the
+// k-th, then a sort of the k alone
+static void select_first_entries(DirEntry *items, int count, int k) {
+    int lo = 0;
+    int hi = count - 1;
+    while (lo < hi) {
+        // Median of three keeps listings that arrive sorted linear
+        int mid = lo + (hi - lo) / 2;
+        if (compare_entries(&items[mid], &items[lo]) < 0) {
+            swap_entries(&items[mid], &items[lo]);
+        }
+        if (compare_entries(&items[hi], &items[lo]) < 0) {
+            swap_entries(&items[hi], &items[lo]);
+        }
+        if (compare_entries(&items[hi], &items[mid]) < 0) {
+            swap_entries(&items[hi], &items[mid]);
+        }
+        
+        DirEntry pivot = items[mid];
+        int i = lo;
+        int j = hi;
+        while (i <= j) {
+            while (compare_entries(&items[i], &pivot) < 0) {
+                i++;
+            }
+            while (compare_entries(&items[j], &pivot) > 0) {
+                j--;
+            }
+            if (i <= j) {
+                swap_entries(&items[i], &items[j]);
+                i++;
+                j--;
+            }
+        }
+        if (k - 1 <= j) {
+            hi = j;
+        } else if (k - 1 >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    qsort(items, k, sizeof(DirEntry), compare_entries);
+}
+
+#ifndef _WIN32
+static int resolve_pending_entries(TreeWalk *walk, int dir_fd, DirEntry *items, int count);
+#endif
+
+// Cut an unsorted listing to its first max_children_per_dir entries in
+// sorted order and count the others in rest. Only the entries shown are
+// sorted, stat'ed and matched against ignore files: they are selected a
+// window at a time, and the window is refilled from the others as
+// entries drop out. The others are counted by the type readdir gave;
+// those it didn't (symlinks, unknown types) count as files rather than
+// being stat'ed, unless use_dtype is off. Returns false, failing the
+// walk, if out of memory.
+static bool cap_listing(TreeWalk *walk, int dir_fd, const IgnoreScope *scope, DirEntry *items,
+                        int *count, ListingRest *rest) {
+    int n = *count;
+    int shown = 0;
+    while (shown < walk->child_cap && shown < n && !walk_failed(walk)) {
+        int want = walk->child_cap - shown < n - shown ? walk->child_cap - shown : n - shown;
+        select_first_entries(items + shown, n - shown, want);
+        int kept = want;
+#ifndef _WIN32
+        kept = resolve_pending_entries(walk, dir_fd, items + shown, want);
+#endif
+        if (!filter_ignored(walk, scope, items + shown, &kept)) {
+            return false;
+        }
+        
+        // Candidates from the end fill the places of the dropped entries
+        int left = n - (shown + want);
+        int move = left < want - kept ? left : want - kept;
+        memcpy(items + shown + kept, items + n - move, move * sizeof(DirEntry));
+        shown += kept;
+        n = shown + left;
+    }
+    
+    DirEntry *others = items + shown;
+    int left = n - shown;
+#ifndef _WIN32
+    if (!walk->config->use_dtype) {
+        left = resolve_pending_entries(walk, dir_fd, others, left);
+    }
+#else
+    (void)dir_fd;
+#endif
+    int counted = 0;
+    for (int i = 0; i < left; i++) {
+        if (others[i].needs_stat) {
+            others[i].needs_stat = false;
+            others[i].is_dir = false;
+            if (skips_entry(walk, others[i].name, others[i].name_len, false)) {
+                continue;
+            }
+        }
+        others[counted++] = others[i];
+    }
+    if (walk_failed(walk) || !filter_ignored(walk, scope, others, &counted)) {
+        return false;
+    }
+    for (int i = 0; i < counted; i++) {
+        rest->dirs += others[i].is_dir;
+        rest->files += !others[i].is_dir;
+    }
+    *count = shown;
+    return true;
+}
+
+#ifdef _WIN32
+// Identify a directory by its volume serial number and file index
+static bool dir_id_from_path(const char *path, DirId *id) {
+    HANDLE handle = CreateFile(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(handle, &info);
+    CloseHandle(handle);
+    if (!ok) {
+        return false;
+    }
+    id->dev = info.dwVolumeSerialNumber;
+    id->ino = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    return true;
+}
+#else
+// Classify an entry from its d_type. Returns false when a stat() is needed:
+// d_type is disabled, DT_UNKNOWN, or a symlink whose target type decides
+// whether we descend into it.
+static bool entry_type_from_dirent(TreeWalk *walk, unsigned char d_type, bool *is_dir) {
+    if (walk->config->use_dtype && d_type != DT_UNKNOWN && d_type != DT_LNK) {
+        *is_dir = (d_type == DT_DIR);
+        if (walk->stats) {
+            walk->stats->stats_avoided++;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Classify an entry with fstatat() relative to its directory descriptor.
+// Symlinks are followed so that links to directories are descended into.
+static bool stat_entry(TreeWalk *walk, int dir_fd, const char *name, unsigned char d_type,
+                       bool *is_dir, bool *is_link) {
+    struct stat st;
+    int flags = AT_SYMLINK_NOFOLLOW;
+    
+    // A known symlink only needs the followed stat
+    if (d_type == DT_LNK) {
+        *is_link = true;
+        flags = 0;
+    }
+    
+    if (walk->stats) {
+        walk->stats->stat_calls++;
+    }
+    if (fstatat(dir_fd, name, &st, flags) != 0) {
+        return false;
+    }
+    
+    if (S_ISLNK(st.st_mode)) {
+        *is_link = true;
+        if (walk->stats) {
+            walk->stats->stat_calls++;
+        }
+        if (fstatat(dir_fd, name, &st, 0) != 0) {
+            return false;
+        }
+    }
+    
+    *is_dir = S_ISDIR(st.st_mode);
+    return true;
+}
+
+// Identify an open directory by its device and inode, keeping the rest
+// of its stat for the baseline check
+static bool stat_dir_fd(int fd, struct stat *st, DirId *id) {
+    if (fstat(fd, st) != 0) {
+        return false;
+    }
+    id->dev = (uint64_t)st->st_dev;
+    id->ino = (uint64_t)st->st_ino;
+    return true;
+}
+#ifdef __linux__
+// Record layout returned by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+// Reads the entries of one open directory, either through readdir() or,
+// on Linux when a buffer is configured, with raw getdents64 calls whose
+// records are parsed in place
+typedef struct {
+    int fd;
+    DIR *stream;                 // readdir backend
+    char *buf;                   // getdents64 backend (shared walk buffer)
+    size_t buf_size;
+    size_t pos;
+    size_t len;
+    int error;                   // errno of a failed read, 0 if the listing is complete
+} DirReader;
+
+// Start reading the directory behind fd, taking ownership of the descriptor
+static bool dir_reader_open(DirReader *reader, int fd, const TreeWalk *walk) {
+    reader->fd = fd;
+    reader->stream = NULL;
+    reader->buf = walk->dirent_buf;
+    reader->buf_size = walk->dirent_buf_size;
+    reader->pos = 0;
+    reader->len = 0;
+    reader->error = 0;
+    
+    if (reader->buf) {
+        return true;
+    }
+    
+    reader->stream = fdopendir(fd);
+    if (!reader->stream) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return false;
+    }
+    return true;
+}
+
+// Fetch the next entry; the name stays valid until the following call.
+// Returns false at the end of the listing, or with reader->error set when
+// reading failed.
+static bool dir_reader_next(DirReader *reader, const char **name, unsigned char *d_type) {
+#ifdef __linux__
+    if (reader->buf) {
+        if (reader->pos >= reader->len) {
+            long n = syscall(SYS_getdents64, reader->fd, reader->buf, reader->buf_size);
+            if (n <= 0) {
+                reader->error = (n < 0) ? errno : 0;
+                return false;
+            }
+            reader->len = (size_t)n;
+            reader->pos = 0;
+        }
+        
+        struct linux_dirent64 *record = (struct linux_dirent64 *)(reader->buf + reader->pos);
+        reader->pos += record->d_reclen;
+        *name = record->d_name;
+        *d_type = record->d_type;
+        return true;
+    }
+#endif
+    
+    errno = 0;
+    struct dirent *entry = readdir(reader->stream);
+    if (!entry) {
+        reader->error = errno;
+        return false;
+    }
+    *name = entry->d_name;
+#ifdef _DIRENT_HAVE_D_TYPE
+    *d_type = entry->d_type;
+#else
+    *d_type = DT_UNKNOWN;
+#endif
+    return true;
+}
+
+// Release the directory and its descriptor
+static void dir_reader_close(DirReader *reader) {
+    if (reader->stream) {
+        closedir(reader->stream);
+    } else {
+        close(reader->fd);
+    }
+}
+
+// Smallest getdents64 buffer accepted; one page always fits the largest record
+#define MIN_DIRENT_BUFFER 4096
+
+#ifdef DIRTREE_HAVE_IO_URING
+// Number of statx requests submitted to the ring at once
+#define STAT_RING_ENTRIES 256
+
+// Minimal io_uring instance used to classify a directory's entries with
+// batches of IORING_OP_STATX instead of one blocking stat per entry
+typedef struct StatRing {
+    int fd;
+    unsigned entries;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned in_flight;          // Requests of a failed run the kernel may still complete
+    struct statx results[STAT_RING_ENTRIES];
+} StatRing;
+
+// Consume the completions posted so far, storing each one's code in
+// res[user_data] unless res is NULL. Returns how many there were.
+static unsigned stat_ring_reap(StatRing *ring, int *res) {
+    unsigned head = *ring->cq_head;
+    unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned reaped = cq_tail - head;
+    for (; head != cq_tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        if (res) {
+            res[cqe->user_data] = cqe->res;
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Tear down a ring created by stat_ring_create
+static void stat_ring_destroy(StatRing *ring) {
+    if (!ring) {
+        return;
+    }
+    // Requests left in flight by a failed run still write into results:
+    // wait for them, and if even that fails leak the ring rather than
+    // free memory the kernel may write to
+    while (ring->in_flight > 0) {
+        long ret = syscall(__NR_io_uring_enter, ring->fd, 0, ring->in_flight,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            close(ring->fd);
+            return;
+        }
+        unsigned reaped = stat_ring_reap(ring, NULL);
+        ring->in_flight -= reaped < ring->in_flight ? reaped : ring->in_flight;
+    }
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+// Set up a ring, returning NULL when io_uring is unavailable (old kernel,
+// seccomp filter, disabled by sysctl) so the caller falls back to fstatat()
+static StatRing *stat_ring_create(void) {
+    StatRing *ring = (StatRing *)calloc(1, sizeof(StatRing));
+    if (!ring) {
+        return NULL;
+    }
+    
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, STAT_RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+    
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+    }
+    
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        stat_ring_destroy(ring);
+        return NULL;
+    }
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            stat_ring_destroy(ring);
+            return NULL;
+        }
+    }
+    
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        stat_ring_destroy(ring);
+        return NULL;
+    }
+    
+    char *sq = (char *)ring->sq_ptr;
+    char *cq = (char *)ring->cq_ptr;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    
+    if (ring->entries > STAT_RING_ENTRIES) {
+        ring->entries = STAT_RING_ENTRIES;
+    }
+    return ring;
+}
+
+// Submit one statx per index in batch and wait for all of them. Each
+// result lands in ring->results[slot]; res[slot] receives the completion
+// code (0 or -errno).
+static bool stat_ring_run(StatRing *ring, int dir_fd, DirEntry *items, const int *batch,
+                          unsigned n, int *res) {
+    unsigned tail = *ring->sq_tail;
+    unsigned mask = *ring->sq_mask;
+    
+    for (unsigned slot = 0; slot < n; slot++) {
+        DirEntry *item = &items[batch[slot]];
+        unsigned index = tail & mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dir_fd;
+        sqe->addr = (uint64_t)(uintptr_t)item->name;
+        sqe->len = STATX_TYPE | STATX_MODE;
+        sqe->off = (uint64_t)(uintptr_t)&ring->results[slot];
+        // Known symlinks are followed directly; unknown entries are probed
+        // without following so links can be told apart
+        sqe->statx_flags = (item->d_type == DT_LNK) ? 0 : AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = slot;
+        
+        ring->sq_array[index] = index;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    
+    // The kernel may take fewer requests than offered; it then returns
+    // without waiting and the rest is offered again. A busy ring (EAGAIN,
+    // EBUSY) takes more only once completions have been reaped.
+    unsigned submitted = 0;
+    unsigned done = 0;
+    bool busy = false;
+    while (done < n) {
+        unsigned to_submit = busy ? 0 : n - submitted;
+        unsigned to_wait = to_submit > 0 ? n - done : submitted - done;
+        long ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, to_wait,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            if ((errno != EAGAIN && errno != EBUSY) || submitted == done) {
+                ring->in_flight = submitted - done;
+                return false;
+            }
+            busy = true;
+        } else if (ret >= 0) {
+            busy = false;
+            if (to_submit > 0) {
+                submitted += (unsigned)ret;
+            }
+        }
+        done += stat_ring_reap(ring, res);
+    }
+    return true;
+}
+#endif
+
+// Classify the entries left pending during the scan, then apply the skip
+// rules that depend on their type. Entries that vanish or are skipped are
+// dropped; returns the new entry count.
+static int resolve_pending_entries(TreeWalk *walk, int dir_fd, DirEntry *items, int count) {
+#ifdef DIRTREE_HAVE_IO_URING
+    StatRing *ring = walk->ring;
+    int batch[STAT_RING_ENTRIES];
+    int res[STAT_RING_ENTRIES];
+    int next = 0;
+    
+    while (ring) {
+        unsigned n = 0;
+        while (next < count && n < ring->entries) {
+            if (items[next].needs_stat) {
+                batch[n++] = next;
+            }
+            next++;
+        }
+        if (n == 0) {
+            break;
+        }
+        
+        if (!stat_ring_run(ring, dir_fd, items, batch, n, res)) {
+            // The ring broke mid-run; finish this walk synchronously
+            stat_ring_destroy(ring);
+            walk->ring = NULL;
+            break;
+        }
+        
+        for (unsigned slot = 0; slot < n; slot++) {
+            DirEntry *item = &items[batch[slot]];
+            if (res[slot] == -EINVAL || res[slot] == -EOPNOTSUPP) {
+                continue;  // Kernel without IORING_OP_STATX: stat synchronously below
+            }
+            
+            item->needs_stat = false;
+            if (walk->stats) {
+                walk->stats->stats_batched++;
+            }
+            if (res[slot] < 0) {
+                // Unreadable entry, dropped below like a failed stat
+                item->name = NULL;
+                continue;
+            }
+            
+            mode_t mode = ring->results[slot].stx_mode;
+            if (S_ISLNK(mode)) {
+                // Probed without following: resolve the target below
+                item->needs_stat = true;
+                item->d_type = DT_LNK;
+                continue;
+            }
+            item->is_link = (item->d_type == DT_LNK);
+            item->is_dir = S_ISDIR(mode);
+        }
+    }
+#endif
+    
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        DirEntry *item = &items[i];
+        bool keep = item->name != NULL;
+        
+        if (keep && item->needs_stat) {
+            keep = stat_entry(walk, dir_fd, item->name, item->d_type,
+                              &item->is_dir, &item->is_link);
+            item->needs_stat = false;
+        }
+        if (keep) {
+            keep = !skips_entry(walk, item->name, item->name_len, item->is_dir);
+        }
+        if (keep) {
+            items[kept++] = *item;
+        } else {
+            walk->links_dropped |= item->is_link || item->d_type == DT_LNK;
+        }
+    }
+    return kept;
+}
+
+// Read every entry of an open directory, classifying it and applying the
+// skip rules; returns the entries unsorted and stores their number in count.
+// Returns NULL, failing the walk, if out of memory.
+static DirEntry *collect_entries(TreeWalk *walk, DirReader *reader, int *count) {
+    const char *name;
+    unsigned char d_type;
+    int n = 0;
+    int pending = 0;
+    
+    walk->ignore_found = 0;
+    while (!(walk->budgeted && budget_spent(walk)) && dir_reader_next(reader, &name, &d_type)) {
+        // Skip . and ..
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        
+        if (walk->stats) {
+            walk->stats->entries_scanned++;
+        }
+        note_ignore_file(walk, name);
+        size_t name_len = strlen(name);
+        
+        // Check file type, trusting d_type unless it is unknown or a symlink.
+        // With a stat ring the lookup is deferred and batched after the scan.
+        bool is_directory = false;
+        bool is_link = false;
+        bool needs_stat = false;
+        if (!entry_type_from_dirent(walk, d_type, &is_directory)) {
+            // Entries left out whatever their type cost no stat
+            if (skips_entry(walk, name, name_len, false) && skips_entry(walk, name, name_len, true)) {
+                continue;
+            }
+            // A capped listing only stats the entries it shows
+            if (walk->ring || walk->child_cap > 0) {
+                needs_stat = true;
+            } else if (!stat_entry(walk, reader->fd, name, d_type, &is_directory, &is_link)) {
+                walk->links_dropped |= is_link;
+                continue;  // Skip if we can't stat the file
+            }
+        }
+        
+        // Check skip conditions
+        if (!needs_stat && skips_entry(walk, name, name_len, is_directory)) {
+            walk->links_dropped |= is_link;
+            continue;
+        }
+        
+        DirEntry *item = scratch_entry(walk, n);
+        if (!item) {
+            break;
+        }
+        item->path = NULL;
+        item->name = arena_strndup(&walk->arena, name, name_len);
+        if (!item->name) {
+            walk_out_of_memory(walk);
+            break;
+        }
+        item->name_len = (unsigned int)name_len;
+        item->is_dir = is_directory;
+        item->is_link = is_link;
+        item->needs_stat = needs_stat;
+        item->d_type = d_type;
+        item->prune = PRUNE_UNKNOWN;
+        item->node = INDEX_NONE;
+        
+        n++;
+        pending += needs_stat;
+    }
+    
+    // A listing the time budget cut short is dropped rather than shown
+    *count = 0;
+    if (walk_failed(walk) || walk->truncated) {
+        return NULL;
+    }
+    if (pending > 0 && (walk->child_cap == 0 || n <= walk->child_cap)) {
+        n = resolve_pending_entries(walk, reader->fd, walk->scratch, n);
+    }
+    
+    DirEntry *items = commit_entries(walk, n);
+    if (items) {
+        *count = n;
+    }
+    return items;
+}
+
+// Check whether a directory still matches its node in the baseline, so
+// the saved listing can stand in for reading it: same inode and device,
+// same mtime and ctime, and stamped early enough to be trusted. A listing
+// that left out symlinks for their targets (dangling, or skipped by a rule
+// depending on the type) is never reused: the links aren't in it to be
+// checked again.
+static bool matches_baseline(const TreeWalk *walk, const struct stat *st, uint32_t node) {
+    const IndexNode *saved = &walk->baseline->nodes[node];
+    int64_t mtime = STAT_TIME_NS(*st, m);
+    int64_t ctime = STAT_TIME_NS(*st, c);
+    uint32_t needed = INDEX_NODE_LISTED | INDEX_NODE_STAMPED;
+    
+    return (saved->flags & (needed | INDEX_NODE_LINKS_DROPPED)) == needed &&
+           saved->ino == (uint64_t)st->st_ino && saved->dev == (uint64_t)st->st_dev &&
+           saved->mtime == mtime && saved->ctime == ctime &&
+           mtime < walk->baseline_trusted && ctime < walk->baseline_trusted;
+}
+
+// List an unchanged directory from its baseline node; the entries are
+// already filtered and sorted. Symlinks are classified again, since their
+// targets can change without touching this directory.
+static DirEntry *collect_baseline_entries(TreeWalk *walk, int dir_fd, uint32_t node, int *count) {
+    const DirtreeIndex *baseline = walk->baseline;
+    const IndexNode *dir = &baseline->nodes[node];
+    int n = 0;
+    
+    for (uint32_t i = node + 1; i < dir->end; i = baseline->nodes[i].end) {
+        const IndexNode *source = &baseline->nodes[i];
+        const char *name = baseline->strings + source->name;
+        bool is_directory = (source->flags & INDEX_NODE_DIR) != 0;
+        bool is_link = (source->flags & INDEX_NODE_LINK) != 0;
+        
+        if (is_link && (!stat_entry(walk, dir_fd, name, DT_LNK, &is_directory, &is_link) ||
+                        skips_entry(walk, name, source->name_len, is_directory))) {
+            walk->links_dropped = true;
+            continue;
+        }
+        
+        // Names stay in the mapped baseline
+        DirEntry *item = scratch_entry(walk, n);
+        if (!item) {
+            *count = 0;
+            return NULL;
+        }
+        item->path = NULL;
+        item->name = (char *)name;
+        item->name_len = source->name_len;
+        item->is_dir = is_directory;
+        item->is_link = is_link;
+        item->needs_stat = false;
+        item->d_type = 0;
+        item->prune = PRUNE_UNKNOWN;
+        item->node = i;
+        n++;
+    }
+    
+    DirEntry *items = commit_entries(walk, n);
+    *count = items ? n : 0;
+    return items;
+}
+
+// Pair the sorted entries of a re-read directory with their namesakes
+// among the children of its baseline node, so unchanged directories
+// further down can still be reused
+static void match_baseline_entries(const TreeWalk *walk, DirEntry *items, int count, uint32_t node) {
+    const DirtreeIndex *baseline = walk->baseline;
+    const IndexNode *dir = &baseline->nodes[node];
+    uint32_t i = (dir->flags & INDEX_NODE_LISTED) ? node + 1 : dir->end;
+    
+    for (int k = 0; k < count; k++) {
+        items[k].node = INDEX_NONE;
+        int order = 1;
+        while (i < dir->end &&
+               (order = strcmp(baseline->strings + baseline->nodes[i].name, items[k].name)) < 0) {
+            i = baseline->nodes[i].end;
+        }
+        if (i < dir->end && order == 0) {
+            items[k].node = i;
+        }
+    }
+}
+
+// List the directory open as dir_fd, which reader takes over, sorted by
+// name. One that still matches its baseline node (st is its stat, NULL if
+// unknown) is listed from the snapshot without being read. Ignore files
+// read along the way are added to scope. Entries past the walk's cap are
+// counted in rest instead. Returns NULL, with the descriptor closed, when
+// it can't be read or the walk failed; name identifies it in error reports.
+static DirEntry *list_directory(TreeWalk *walk, int dir_fd, const struct stat *st,
+                                uint32_t baseline_node, const char *name, IgnoreScope *scope,
+                                DirReader *reader, int *count, ListingRest *rest) {
+    bool have_baseline = walk->baseline && baseline_node != INDEX_NONE;
+    walk->scope = scope;
+    walk->links_dropped = false;
+    rest->files = 0;
+    rest->dirs = 0;
+    
+    if (have_baseline && st && matches_baseline(walk, st, baseline_node)) {
+        // Nothing to read: the reader only holds the descriptor
+        reader->fd = dir_fd;
+        reader->stream = NULL;
+        reader->buf = NULL;
+        reader->error = 0;
+        DirEntry *items = collect_baseline_entries(walk, dir_fd, baseline_node, count);
+        if (!items || (walk->child_cap > 0 && *count > walk->child_cap &&
+                       !cap_listing(walk, dir_fd, scope, items, count, rest))) {
+            dir_reader_close(reader);
+            return NULL;
+        }
+        if (walk->stats) {
+            walk->stats->dirs_reused++;
+        }
+        return items;
+    }
+    
+    if (!dir_reader_open(reader, dir_fd, walk)) {
+        note_unreadable_scope(walk, errno, scope, name);
+        return NULL;
+    }
+    
+    // A listing cut short by a read error is still shown
+    DirEntry *items = collect_entries(walk, reader, count);
+    if (reader->error != 0) {
+        note_unreadable_scope(walk, reader->error, scope, name);
+    }
+    
+    // A capped listing loads the ignore files here but applies them only
+    // to the entries it selects
+    bool capped = walk->child_cap > 0 && *count > walk->child_cap;
+    int none = 0;
+    if (!items || !apply_ignore_files(walk, dir_fd, NULL, scope, items, capped ? &none : count) ||
+        (capped && !cap_listing(walk, dir_fd, scope, items, count, rest))) {
+        dir_reader_close(reader);
+        return NULL;
+    }
+    
+    // Sort entries alphabetically
+    if (!capped) {
+        qsort(items, *count, sizeof(DirEntry), compare_entries);
+    }
+    if (have_baseline) {
+        match_baseline_entries(walk, items, *count, baseline_node);
+    }
+    return items;
+}
+
+// Open a listed directory relative to its parent's descriptor. Real
+// directories use O_NOFOLLOW so a concurrent swap for a symlink can't
+// redirect the walk.
+static int open_child_dir(int parent_fd, const DirEntry *item) {
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (!item->is_link) {
+        flags |= O_NOFOLLOW;
+    }
+    return openat(parent_fd, item->name, flags);
+}
+
+// The descriptor of a directory being walked, which its children are
+// opened and stat'ed through. A deep branch would hold one per level, so
+// past held_cap the one opened longest ago is closed and reopened from
+// the root when its directory needs it again. Slots stay put while the
+// frames naming them are copied around.
+typedef struct HeldDir {
+    DirReader reader;            // reader.fd is -1 while closed for held_cap
+    const char *path;            // Below the root ("" for the root itself)
+    bool have_id;                // id is checked on reopening, so a swapped path isn't followed
+    DirId id;
+    bool in_use;
+    unsigned long opened;        // held_clock when last (re)opened
+} HeldDir;
+
+// Bounds on held_cap, which is otherwise half the soft RLIMIT_NOFILE
+#define HELD_DIRS_MIN 8
+#define HELD_DIRS_MAX 1024
+
+// Close the open descriptor held longest, other than slot keep's, to make
+// room for another. Returns false when there is none to close.
+static bool close_oldest_held_dir(TreeWalk *walk, int keep) {
+    int oldest = -1;
+    for (int i = 0; i < walk->held_count; i++) {
+        const HeldDir *dir = &walk->held_dirs[i];
+        if (i != keep && dir->in_use && dir->reader.fd >= 0 &&
+            (oldest < 0 || dir->opened < walk->held_dirs[oldest].opened)) {
+            oldest = i;
+        }
+    }
+    if (oldest < 0) {
+        return false;
+    }
+    dir_reader_close(&walk->held_dirs[oldest].reader);
+    walk->held_dirs[oldest].reader.fd = -1;
+    walk->held_dirs[oldest].reader.stream = NULL;
+    walk->held_open--;
+    return true;
+}
+
+// Hand the reader of a directory just listed, at path below the root, to
+// the walk; its descriptor may be -1 for one listed without opening it.
+// Returns its slot, or -1 with the reader closed if out of
+// memory, which fails the walk.
+static int hold_dir(TreeWalk *walk, DirReader *reader, const char *path, bool have_id, DirId id) {
+    int slot = 0;
+    while (slot < walk->held_count && walk->held_dirs[slot].in_use) {
+        slot++;
+    }
+    if (slot == walk->held_capacity) {
+        int capacity = walk->held_capacity ? walk->held_capacity * 2 : 16;
+        HeldDir *held = (HeldDir *)realloc(walk->held_dirs, capacity * sizeof(HeldDir));
+        if (!held) {
+            dir_reader_close(reader);
+            walk_out_of_memory(walk);
+            return -1;
+        }
+        walk->held_dirs = held;
+        walk->held_capacity = capacity;
+    }
+    if (slot == walk->held_count) {
+        walk->held_count++;
+    }
+    
+    // A reader without a descriptor is opened on first use
+    HeldDir *dir = &walk->held_dirs[slot];
+    dir->in_use = false;
+    if (reader->fd >= 0) {
+        if (walk->held_open >= walk->held_cap) {
+            close_oldest_held_dir(walk, slot);
+        }
+        walk->held_open++;
+    }
+    dir->reader = *reader;
+    dir->path = path;
+    dir->have_id = have_id;
+    dir->id = id;
+    dir->in_use = true;
+    dir->opened = ++walk->held_clock;
+    return slot;
+}
+
+// Open the directory at path below root again, one component at a time.
+// Returns -1 with errno set if it can't be opened.
+static int reopen_dir(const char *root, const char *path) {
+    char name[NAME_MAX + 1];
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    while (fd >= 0 && *path) {
+        size_t len = strcspn(path, "/");
+        int next = -1;
+        if (len > NAME_MAX) {
+            errno = ENAMETOOLONG;
+        } else {
+            memcpy(name, path, len);
+            name[len] = '\0';
+            next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        int open_errno = errno;
+        close(fd);
+        errno = open_errno;
+        fd = next;
+        path += len + (path[len] == '/');
+    }
+    return fd;
+}
+
+// The descriptor of the directory held in slot, reopened if it was closed
+// for held_cap. Returns -1 with errno set if it can't be reopened, or now
+// names another directory.
+static int held_dir_fd(TreeWalk *walk, int slot) {
+    if (walk->held_dirs[slot].reader.fd >= 0) {
+        return walk->held_dirs[slot].reader.fd;
+    }
+    if (walk->held_open >= walk->held_cap) {
+        close_oldest_held_dir(walk, slot);
+    }
+    
+    HeldDir *dir = &walk->held_dirs[slot];
+    int fd = reopen_dir(walk->root_path, dir->path);
+    while (fd < 0 && out_of_descriptors(errno) && close_oldest_held_dir(walk, slot)) {
+        fd = reopen_dir(walk->root_path, dir->path);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    DirId id;
+    if (dir->have_id && (!stat_dir_fd(fd, &st, &id) || id.dev != dir->id.dev || id.ino != dir->id.ino)) {
+        close(fd);
+        errno = ENOENT;
+        return -1;
+    }
+    dir->reader.fd = fd;
+    dir->opened = ++walk->held_clock;
+    walk->held_open++;
+    return fd;
+}
+
+// Give back the slot of a directory the walk is done with
+static void release_held_dir(TreeWalk *walk, int slot) {
+    HeldDir *dir = &walk->held_dirs[slot];
+    if (dir->reader.fd >= 0) {
+        dir_reader_close(&dir->reader);
+        walk->held_open--;
+    }
+    dir->in_use = false;
+    while (walk->held_count > 0 && !walk->held_dirs[walk->held_count - 1].in_use) {
+        walk->held_count--;
+    }
+}
+#endif
+
+// Set up a walker and the per-walker resources its configuration asks for.
+// Returns false if out of memory; the walker can still be released.
+static bool init_tree_walk(TreeWalk *walk, const DirtreeConfig *config, const SkipMatcher *skip,
+                           StringBuffer *sb, DirtreeStats *stats) {
+    walk->config = config;
+    walk->skip = skip;
+    walk->sb = sb;
+    walk->visitor = NULL;
+    walk->userdata = NULL;
+    walk->prefix = NULL;
+    walk->prefix_len = 0;
+    walk->prefix_capacity = 0;
+    init_arena(&walk->arena);
+    walk->scratch = NULL;
+    walk->scratch_capacity = 0;
+    walk->visited.slots = NULL;
+    walk->visited.size = 0;
+    walk->visited.capacity = 0;
+    walk->empty_dirs.slots = NULL;
+    walk->empty_dirs.size = 0;
+    walk->empty_dirs.capacity = 0;
+    walk->ancestors.ids = NULL;
+    walk->ancestors.depth = 0;
+    walk->ancestors.capacity = 0;
+    walk->held_dirs = NULL;
+    walk->held_count = 0;
+    walk->held_capacity = 0;
+    walk->held_open = 0;
+    walk->held_cap = 0;
+    walk->held_clock = 0;
+    walk->root_path = NULL;
+    walk->dirent_buf = NULL;
+    walk->dirent_buf_size = 0;
+    walk->ring = NULL;
+    walk->stats = stats;
+    walk->index = config->index;
+    walk->baseline = NULL;
+    walk->baseline_trusted = 0;
+    walk->settled = NULL;
+    walk->use_ignore_files = config->use_ignore_files && !config->index;
+    walk->ignore_found = 0;
+    walk->links_dropped = false;
+    walk->scope = NULL;
+    walk->entry_path = NULL;
+    walk->entry_path_capacity = 0;
+    walk->child_cap = 0;
+    walk->budgeted = false;
+    walk->entries_left = ULONG_MAX;
+    walk->deadline = 0;
+    walk->clock_countdown = 1;
+    walk->truncated = NULL;
+    init_error(&walk->error);
+    
+#ifndef _WIN32
+    // Leave the other half of the descriptor limit to the caller
+    struct rlimit limit;
+    walk->held_cap = HELD_DIRS_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur / 2 < HELD_DIRS_MAX) {
+        walk->held_cap = limit.rlim_cur / 2 > HELD_DIRS_MIN ? (int)(limit.rlim_cur / 2) : HELD_DIRS_MIN;
+    }
+#endif
+    
+#ifdef __linux__
+    // Read directories with getdents64 into one large buffer when configured
+    if (config->dirent_buffer_size > 0) {
+        walk->dirent_buf_size = config->dirent_buffer_size;
+        if (walk->dirent_buf_size < MIN_DIRENT_BUFFER) {
+            walk->dirent_buf_size = MIN_DIRENT_BUFFER;
+        }
+        walk->dirent_buf = (char *)malloc(walk->dirent_buf_size);
+        if (!walk->dirent_buf) {
+            return false;
+        }
+    }
+#endif
+    
+#ifdef DIRTREE_HAVE_IO_URING
+    // Batch stat calls through io_uring when asked; stays NULL (synchronous
+    // fstatat) when the kernel refuses
+    if (config->use_io_uring) {
+        walk->ring = stat_ring_create();
+    }
+#endif
+    return true;
+}
+
+// Release what init_tree_walk acquired
+static void release_tree_walk(TreeWalk *walk) {
+#ifndef _WIN32
+    for (int i = 0; i < walk->held_count; i++) {
+        if (walk->held_dirs[i].in_use) {
+            release_held_dir(walk, i);
+        }
+    }
+#endif
+    free(walk->held_dirs);
+    walk->held_dirs = NULL;
+    free(walk->root_path);
+    walk->root_path = NULL;
+    free(walk->dirent_buf);
+    walk->dirent_buf = NULL;
+    free(walk->ancestors.ids);
+    walk->ancestors.ids = NULL;
+    free(walk->scratch);
+    walk->scratch = NULL;
+    free(walk->prefix);
+    walk->prefix = NULL;
+    free(walk->entry_path);
+    walk->entry_path = NULL;
+    free_arena(&walk->arena);
+#ifdef DIRTREE_HAVE_IO_URING
+    stat_ring_destroy(walk->ring);
+    walk->ring = NULL;
+#endif
+}
+
+// Append one line of the tree: the branch prefix, a connector, an
+// optional mark and the text, copied straight into the output
+static void append_tree_line(TreeWalk *walk, const TreePiece *mark, const char *text,
+                             size_t text_len, bool is_last) {
+    DirtreeFormat format = walk->config->format;
+    const TreePiece *connector = is_last ? TREE_CORNER(format) : TREE_BRANCH(format);
+    size_t mark_len = mark ? mark->len : 0;
+    size_t len = walk->prefix_len + connector->len + mark_len + text_len + 1;
+    
+    char *line = string_buffer_reserve(walk->sb, len);
+    if (!line) {
+        record_error(&walk->error, walk->sb->error, walk->sb->sys_errno, NULL);
+        return;
+    }
+    if (walk->prefix_len > 0) {
+        memcpy(line, walk->prefix, walk->prefix_len);
+        line += walk->prefix_len;
+    }
+    memcpy(line, connector->str, connector->len);
+    line += connector->len;
+    if (mark_len > 0) {
+        memcpy(line, mark->str, mark_len);
+        line += mark_len;
+    }
+    memcpy(line, text, text_len);
+    line[text_len] = '\n';
+    string_buffer_commit(walk->sb, len);
+}
+
+// Append the line for one entry
+static void append_entry_line(TreeWalk *walk, const DirEntry *item, bool is_last) {
+    append_tree_line(walk, NULL, item->name, item->name_len, is_last);
+}
+
+// Check the budgets before printing a line of text_len bytes after its
+// connector. Once one has run out, print the truncation marker instead;
+// the caller then unwinds. The size budget keeps room for the marker,
+// even one level further down.
+static bool within_budget(TreeWalk *walk, size_t text_len) {
+    const DirtreeConfig *config = walk->config;
+    if (!walk->truncated) {
+        size_t corner = TREE_CORNER(config->format)->len;
+        size_t used = walk->sb->flushed + walk->sb->size;
+        size_t line = walk->prefix_len + corner + text_len + 1;
+        size_t marker = walk->prefix_len + 2 * corner + TRUNCATED_MAX_LEN + 1;
+        if (walk->entries_left == 0) {
+            walk->truncated = TRUNCATED_ENTRIES;
+        } else if (config->max_output_bytes > 0 && used + line + marker > config->max_output_bytes) {
+            walk->truncated = TRUNCATED_BYTES;
+        } else {
+            budget_spent(walk);
+        }
+    }
+    if (walk->truncated) {
+        append_tree_line(walk, NULL, walk->truncated, strlen(walk->truncated), true);
+        return false;
+    }
+    walk->entries_left--;
+    return true;
+}
+
+// Append the line summarizing the entries of a directory past
+// max_children_per_dir, last in its listing. Returns false if a budget
+// ran out instead.
+static bool append_rest_line(TreeWalk *walk, const ListingRest *rest) {
+    char files[32] = "";
+    char dirs[32] = "";
+    if (rest->files > 0) {
+        snprintf(files, sizeof(files), "%d more file%s", rest->files, rest->files == 1 ? "" : "s");
+    }
+    if (rest->dirs > 0) {
+        snprintf(dirs, sizeof(dirs), "%d more dir%s", rest->dirs, rest->dirs == 1 ? "" : "s");
+    }
+    char text[80];
+    int len = snprintf(text, sizeof(text), "... (%s%s%s)", files, files[0] && dirs[0] ? ", " : "",
+                       dirs);
+    
+    if (walk->budgeted && !within_budget(walk, (size_t)len)) {
+        return false;
+    }
+    append_tree_line(walk, NULL, text, (size_t)len, true);
+    return true;
+}
+
+// Extend the branch prefix for the children of an entry. Returns the
+// previous length, which the caller restores once the children are done.
+// If the prefix can't grow the walk fails and the prefix is left as is.
+static size_t push_prefix(TreeWalk *walk, bool is_last) {
+    DirtreeFormat format = walk->config->format;
+    const TreePiece *segment = is_last ? TREE_SPACE(format) : TREE_VERTICAL(format);
+    size_t saved = walk->prefix_len;
+    
+    if (saved + segment->len > walk->prefix_capacity) {
+        size_t capacity = walk->prefix_capacity ? walk->prefix_capacity * 2 : 256;
+        while (capacity < saved + segment->len) {
+            capacity *= 2;
+        }
+        char *prefix = (char *)realloc(walk->prefix, capacity);
+        if (!prefix) {
+            walk_out_of_memory(walk);
+            return saved;
+        }
+        walk->prefix = prefix;
+        walk->prefix_capacity = capacity;
+    }
+    
+    memcpy(walk->prefix + saved, segment->str, segment->len);
+    walk->prefix_len = saved + segment->len;
+    return saved;
+}
+
+// Apply the cycle policy to a directory about to be listed. Returns false
+// when it must not be entered, or when recording it failed the walk;
+// otherwise it is recorded, and on the ancestor stack it stays until
+// leave_directory.
+static bool enter_directory(TreeWalk *walk, DirId id) {
+    int entered;
+    if (walk->config->cycle_policy == DIRTREE_CYCLES_ANCESTORS) {
+        entered = is_ancestor(&walk->ancestors, id) ? 0 :
+                  push_ancestor(&walk->ancestors, id) ? 1 : -1;
+    } else {
+        entered = mark_visited(&walk->visited, id);
+    }
+    
+    if (entered < 0) {
+        walk_out_of_memory(walk);
+    } else if (entered == 0) {
+        walk->error.dirs_skipped++;
+    }
+    return entered > 0;
+}
+
+// Undo enter_directory once a directory's subtree is done
+static void leave_directory(TreeWalk *walk) {
+    if (walk->config->cycle_policy == DIRTREE_CYCLES_ANCESTORS) {
+        walk->ancestors.depth--;
+    }
+}
+
+// Decide whether a listed directory gets opened: not past the depth limit,
+// and not along a symlink chain the kernel itself would reject. Stores the
+// child's symlink hop count in hops.
+static bool should_descend(const DirtreeConfig *config, const DirEntry *item,
+                           int current_depth, int link_hops, int *hops) {
+    *hops = link_hops + (item->is_link ? 1 : 0);
+    bool within_depth = config->max_depth <= 0 || current_depth < config->max_depth;
+    return item->is_dir && within_depth && *hops <= MAX_SYMLINK_HOPS;
+}
+
+// A directory being walked: its sorted listing and, on POSIX, the slot of
+// the descriptor that anchors the children's openat() lookups
+typedef struct {
+    DirEntry *items;
+    int count;
+    ArenaMark mark;              // Arena top before the listing, restored by close_frame
+    bool have_id;                // Entered under the cycle policy, left by close_frame
+    DirId id;
+    IgnoreScope scope;           // Ignore files in force for the listing
+    ListingRest rest;            // Entries past max_children_per_dir
+    bool links_dropped;          // The listing left out symlinks for their targets
+    bool settled;                // Listed from the baseline, unopened, on a watch's word
+    struct KeptFrame *kept;      // Subdirectories opened ahead by prune_empty
+#ifndef _WIN32
+    int held;                    // Slot in walk->held_dirs
+#endif
+} DirFrame;
+
+// A subdirectory opened ahead of its turn by prune_empty, so that it is
+// still read only once. It stays open, off the ancestor stack, until the
+// walk reaches it.
+typedef struct KeptFrame {
+    struct KeptFrame *next;
+    int index;                   // Entry of the parent frame it lists
+    int link_hops;
+    bool taken;                  // Handed back to the walk, which closes it
+    DirFrame frame;
+} KeptFrame;
+
+#ifdef _WIN32
+// Read every entry of a directory with FindFirstFile, applying the skip
+// rules; stores the unsorted listing in items and count. Returns false if
+// the directory can't be read or the walk failed.
+static bool collect_entries_win32(TreeWalk *walk, const char *dir, DirEntry **items, int *count) {
+    WIN32_FIND_DATA findData;
+    char search_path[PATH_MAX];
+    snprintf(search_path, PATH_MAX, "%s\\*", dir);
+    
+    HANDLE hFind = FindFirstFile(search_path, &findData);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        note_unreadable_scope(walk, (int)GetLastError(), walk->scope, dir);
+        return false;
+    }
+    
+    int n = 0;
+    walk->ignore_found = 0;
+    do {
+        // Skip . and ..
+        if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0) {
+            continue;
+        }
+        
+        if (walk->stats) {
+            walk->stats->entries_scanned++;
+        }
+        note_ignore_file(walk, findData.cFileName);
+        
+        // Check skip conditions
+        bool is_directory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+        size_t name_len = strlen(findData.cFileName);
+        if (skips_entry(walk, findData.cFileName, name_len, is_directory)) {
+            continue;
+        }
+        
+        // Create full path
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s\\%s", dir, findData.cFileName);
+        
+        DirEntry *item = scratch_entry(walk, n);
+        if (!item) {
+            break;
+        }
+        item->path = arena_strndup(&walk->arena, path, strlen(path));
+        item->name = arena_strndup(&walk->arena, findData.cFileName, name_len);
+        if (!item->path || !item->name) {
+            walk_out_of_memory(walk);
+            break;
+        }
+        item->name_len = (unsigned int)name_len;
+        item->is_dir = is_directory;
+        item->is_link = false;
+        item->needs_stat = false;
+        item->d_type = 0;
+        item->prune = PRUNE_UNKNOWN;
+        item->node = INDEX_NONE;
+        
+        n++;
+    } while (!(walk->budgeted && budget_spent(walk)) && FindNextFile(hFind, &findData));
+    
+    if (!walk_failed(walk) && !walk->truncated && GetLastError() != ERROR_NO_MORE_FILES) {
+        note_unreadable_scope(walk, (int)GetLastError(), walk->scope, dir);
+    }
+    FindClose(hFind);
+    if (walk_failed(walk) || walk->truncated) {
+        return false;
+    }
+    *items = commit_entries(walk, n);
+    *count = n;
+    return *items != NULL;
+}
+#endif
+
+// Start walking a directory: apply the cycle policy, then read and sort its
+// entries. On POSIX the directory arrives as an open descriptor that this
+// call takes over and dir only names it in error reports; on Windows dir
+// is the path to list. baseline_node is its node in the walk's baseline,
+// or INDEX_NONE, and outer the ignore scope of its parent (NULL for the
+// root). Returns false when the directory is skipped, can't be read or the
+// walk failed.
+static bool open_frame(TreeWalk *walk, int dir_fd, const char *dir, uint32_t baseline_node,
+                       const IgnoreScope *outer, DirFrame *frame) {
+    // Skip the directory if the cycle policy has already seen it.
+    // Identities that can't be read are not tracked.
+    DirId id;
+#ifdef _WIN32
+    (void)dir_fd;
+    (void)baseline_node;
+    frame->have_id = dir_id_from_path(dir, &id);
+#else
+    struct stat st;
+    frame->have_id = stat_dir_fd(dir_fd, &st, &id);
+#endif
+    frame->id = id;
+    if (frame->have_id && !enter_directory(walk, id)) {
+#ifndef _WIN32
+        close(dir_fd);
+#endif
+        return false;
+    }
+    frame->kept = NULL;
+    frame->rest.files = 0;
+    frame->rest.dirs = 0;
+    frame->links_dropped = false;
+    frame->settled = false;
+    
+    // Everything listed here is given back to the arena by close_frame
+    frame->mark = arena_mark(&walk->arena);
+#ifdef _WIN32
+    const char *name = strrchr(dir, '\\') ? strrchr(dir, '\\') + 1 : dir;
+    walk->scope = &frame->scope;
+    bool listed = enter_ignore_scope(walk, outer, name, &frame->scope) &&
+                  collect_entries_win32(walk, dir, &frame->items, &frame->count) &&
+                  apply_ignore_files(walk, -1, dir, &frame->scope, frame->items, &frame->count);
+    if (listed && walk->child_cap > 0 && frame->count > walk->child_cap) {
+        listed = cap_listing(walk, -1, &frame->scope, frame->items, &frame->count, &frame->rest);
+    } else if (listed) {
+        // Sort entries alphabetically
+        qsort(frame->items, frame->count, sizeof(DirEntry), compare_entries);
+    }
+#else
+    bool listed = enter_ignore_scope(walk, outer, dir, &frame->scope);
+    if (listed) {
+        DirReader reader;
+        frame->items = list_directory(walk, dir_fd, frame->have_id ? &st : NULL, baseline_node,
+                                      dir, &frame->scope, &reader, &frame->count, &frame->rest);
+        frame->links_dropped = walk->links_dropped;
+        frame->held = frame->items ? hold_dir(walk, &reader, frame->scope.path, frame->have_id, id) : -1;
+        listed = frame->held >= 0;
+    } else {
+        close(dir_fd);
+    }
+#endif
+    if (!listed) {
+        arena_release(&walk->arena, frame->mark);
+        if (frame->have_id) {
+            leave_directory(walk);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Start walking a directory of the loaded snapshot: list the entries of
+// node that pass the skip rules and filters; outer is the scope of its
+// parent (NULL for the root). They were sorted when it was saved, and
+// cycles were cut then too. Returns false when node wasn't read or the
+// walk failed.
+static bool open_index_frame(TreeWalk *walk, uint32_t node, const IgnoreScope *outer,
+                             DirFrame *frame) {
+    const DirtreeIndex *index = walk->index;
+    const IndexNode *dir = &index->nodes[node];
+    if (!(dir->flags & INDEX_NODE_LISTED)) {
+        return false;
+    }
+    
+    frame->have_id = false;
+    frame->kept = NULL;
+    frame->rest.files = 0;
+    frame->rest.dirs = 0;
+    frame->links_dropped = (dir->flags & INDEX_NODE_LINKS_DROPPED) != 0;
+    frame->settled = false;
+    frame->mark = arena_mark(&walk->arena);
+    if (!enter_ignore_scope(walk, outer, index->strings + dir->name, &frame->scope)) {
+        return false;
+    }
+    walk->scope = &frame->scope;
+    int n = 0;
+    for (uint32_t i = node + 1; i < dir->end; i = index->nodes[i].end) {
+        const IndexNode *source = &index->nodes[i];
+        const char *name = index->strings + source->name;
+        bool is_directory = (source->flags & INDEX_NODE_DIR) != 0;
+        
+        if (walk->stats) {
+            walk->stats->entries_scanned++;
+        }
+        if (skips_entry(walk, name, source->name_len, is_directory)) {
+            continue;
+        }
+        
+        // Names stay in the mapped string table
+        DirEntry *item = scratch_entry(walk, n);
+        if (!item) {
+            return false;
+        }
+        item->path = NULL;
+        item->name = (char *)name;
+        item->name_len = source->name_len;
+        item->is_dir = is_directory;
+        item->is_link = (source->flags & INDEX_NODE_LINK) != 0;
+        item->needs_stat = false;
+        item->d_type = 0;
+        item->prune = PRUNE_UNKNOWN;
+        item->node = i;
+        n++;
+    }
+    
+    frame->items = commit_entries(walk, n);
+    frame->count = n;
+    if (frame->items && walk->child_cap > 0 && n > walk->child_cap) {
+        return cap_listing(walk, -1, &frame->scope, frame->items, &frame->count, &frame->rest);
+    }
+    return frame->items != NULL;
+}
+
+#ifndef _WIN32
+// Check whether a rescan can list baseline node without opening it: a
+// directory listed and stamped in full, still watched and named by no
+// event since, that holds no symlinks, whose targets can change unseen
+static bool is_settled_dir(const TreeWalk *walk, uint32_t node) {
+    if (!walk->settled || node == INDEX_NONE) {
+        return false;
+    }
+    const IndexNode *nodes = walk->baseline->nodes;
+    const IndexNode *dir = &nodes[node];
+    uint32_t needed = INDEX_NODE_LISTED | INDEX_NODE_STAMPED;
+    DirId id = { dir->dev, dir->ino };
+    if ((dir->flags & (needed | INDEX_NODE_LINKS_DROPPED)) != needed || !is_visited(walk->settled, id)) {
+        return false;
+    }
+    for (uint32_t i = node + 1; i < dir->end; i = nodes[i].end) {
+        if (nodes[i].flags & INDEX_NODE_LINK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Start walking a settled directory (is_settled_dir) from its baseline
+// node, as open_frame would. Its slot starts out closed and is only
+// opened if something below needs the descriptor.
+static bool open_settled_frame(TreeWalk *walk, uint32_t node, const char *name,
+                               const IgnoreScope *outer, DirFrame *frame) {
+    const IndexNode *dir = &walk->baseline->nodes[node];
+    frame->id.dev = dir->dev;
+    frame->id.ino = dir->ino;
+    frame->have_id = true;
+    if (!enter_directory(walk, frame->id)) {
+        return false;
+    }
+    frame->kept = NULL;
+    frame->rest.files = 0;
+    frame->rest.dirs = 0;
+    frame->links_dropped = false;
+    frame->settled = true;
+    frame->mark = arena_mark(&walk->arena);
+    
+    DirReader closed = { -1, NULL, NULL, 0, 0, 0, 0 };
+    walk->scope = &frame->scope;
+    bool listed = enter_ignore_scope(walk, outer, name, &frame->scope) &&
+                  (frame->items = collect_baseline_entries(walk, -1, node, &frame->count)) != NULL;
+    if (listed && walk->child_cap > 0 && frame->count > walk->child_cap) {
+        listed = cap_listing(walk, -1, &frame->scope, frame->items, &frame->count, &frame->rest);
+    }
+    frame->held = listed ? hold_dir(walk, &closed, frame->scope.path, true, frame->id) : -1;
+    if (frame->held < 0) {
+        arena_release(&walk->arena, frame->mark);
+        leave_directory(walk);
+        return false;
+    }
+    if (walk->stats) {
+        walk->stats->dirs_reused++;
+    }
+    return true;
+}
+#endif
+
+// Open the listed subdirectory item of parent as a new frame
+static bool open_child_frame(TreeWalk *walk, const DirFrame *parent, const DirEntry *item,
+                             DirFrame *child) {
+    if (walk->index) {
+        return open_index_frame(walk, item->node, &parent->scope, child);
+    }
+#ifdef _WIN32
+    (void)parent;
+    return open_frame(walk, -1, item->path, INDEX_NONE, &parent->scope, child);
+#else
+    if (is_settled_dir(walk, item->node)) {
+        return open_settled_frame(walk, item->node, item->name, &parent->scope, child);
+    }
+    // The parent keeps its descriptor while more are closed to make room
+    int parent_fd = held_dir_fd(walk, parent->held);
+    int child_fd = parent_fd < 0 ? -1 : open_child_dir(parent_fd, item);
+    while (child_fd < 0 && parent_fd >= 0 && out_of_descriptors(errno) &&
+           close_oldest_held_dir(walk, parent->held)) {
+        child_fd = open_child_dir(parent_fd, item);
+    }
+    if (child_fd < 0) {
+        note_unreadable_child(walk, errno, &parent->scope, item->name);
+        return false;
+    }
+    return open_frame(walk, child_fd, item->name, item->node, &parent->scope, child);
+#endif
+}
+
+// Open the root of a walk: node 0 of the loaded snapshot, or the directory
+// at abs_dir
+static bool open_root_frame(TreeWalk *walk, const char *abs_dir, DirFrame *frame) {
+    if (walk->index) {
+        return open_index_frame(walk, 0, NULL, frame);
+    }
+#ifdef _WIN32
+    return open_frame(walk, -1, abs_dir, INDEX_NONE, NULL, frame);
+#else
+    walk->root_path = strdup(abs_dir);
+    if (!walk->root_path) {
+        walk_out_of_memory(walk);
+        return false;
+    }
+    if (walk->baseline && is_settled_dir(walk, 0)) {
+        return open_settled_frame(walk, 0, abs_dir, NULL, frame);
+    }
+    int root_fd = open(abs_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        note_unreadable(walk, errno, abs_dir);
+        return false;
+    }
+    return open_frame(walk, root_fd, abs_dir, walk->baseline ? 0 : INDEX_NONE, NULL, frame);
+#endif
+}
+
+// Finish with a directory: release its listing and descriptor
+static void close_frame(TreeWalk *walk, DirFrame *frame) {
+    // Subdirectories opened ahead and never reached were already taken
+    // off the ancestor stack
+    for (KeptFrame *kept = frame->kept; kept; kept = kept->next) {
+        if (!kept->taken) {
+            kept->frame.have_id = false;
+            close_frame(walk, &kept->frame);
+        }
+    }
+    arena_release(&walk->arena, frame->mark);
+#ifndef _WIN32
+    if (!walk->index) {
+        release_held_dir(walk, frame->held);
+    }
+#endif
+    if (frame->have_id) {
+        leave_directory(walk);
+    }
+}
+
+#ifndef _WIN32
+// Stat a listed entry relative to its directory, following it only when
+// it was reached through a symlink
+static bool stat_listed_entry(TreeWalk *walk, const DirFrame *frame, const DirEntry *item,
+                              struct stat *st) {
+    int flags = item->is_link ? 0 : AT_SYMLINK_NOFOLLOW;
+    
+    if (walk->stats) {
+        walk->stats->stat_calls++;
+    }
+    int dir_fd = held_dir_fd(walk, frame->held);
+    return dir_fd >= 0 && fstatat(dir_fd, item->name, st, flags) == 0;
+}
+
+// Fill an entry's size and mtime from stat_listed_entry
+static void fill_entry_metadata(TreeWalk *walk, const DirFrame *frame, const DirEntry *item,
+                                DirtreeEntry *entry) {
+    struct stat st;
+    if (stat_listed_entry(walk, frame, item, &st)) {
+        entry->has_metadata = true;
+        entry->size = (unsigned long long)st.st_size;
+        entry->mtime = (long long)st.st_mtime;
+    }
+}
+#endif
+
+// Describe a listed entry for the iterator and visitor APIs
+static void fill_entry(TreeWalk *walk, const DirFrame *frame, const DirEntry *item, int depth,
+                       bool is_last, DirtreeEntry *entry) {
+    entry->name = item->name;
+    entry->depth = depth;
+    entry->is_dir = item->is_dir;
+    entry->is_link = item->is_link;
+    entry->is_last = is_last;
+    entry->has_metadata = false;
+    entry->size = 0;
+    entry->mtime = 0;
+    if (!walk->config->collect_metadata) {
+        return;
+    }
+    
+    if (walk->index) {
+        // Whatever the snapshot kept
+        const IndexNode *source = &walk->index->nodes[item->node];
+        if (source->flags & INDEX_NODE_METADATA) {
+            entry->has_metadata = true;
+            entry->size = source->size;
+            entry->mtime = source->mtime / 1000000000;
+        }
+        return;
+    }
+#ifdef _WIN32
+    (void)frame;
+#else
+    fill_entry_metadata(walk, frame, item, entry);
+#endif
+}
+
+static int last_shown_entry(TreeWalk *walk, DirFrame *frame, int depth, int link_hops);
+
+// Remember that prune_empty left out the directory id, so that its repeats
+// are left out too rather than printed as leaves (DIRTREE_CYCLES_VISITED)
+static void note_empty_dir(TreeWalk *walk, DirId id) {
+    if (walk->empty_dirs.slots && mark_visited(&walk->empty_dirs, id) < 0) {
+        walk_out_of_memory(walk);
+    }
+}
+
+// Check whether prune_empty already left out the directory id
+static bool is_empty_dir(const TreeWalk *walk, DirId id) {
+    return walk->empty_dirs.slots && is_visited(&walk->empty_dirs, id);
+}
+
+// Find out whether prune_empty shows the directory entry i of frame: it
+// does unless it is read and nothing below it is shown. Directories that
+// aren't entered (depth limit, cycles, unreadable) are printed as leaves
+// as usual, except repeats of one already left out. One found to be shown stays open in frame's kept list until
+// the walk gets to it, so nothing is read twice. depth and link_hops are
+// those of frame's entries.
+static bool probe_directory(TreeWalk *walk, DirFrame *frame, int i, int depth, int link_hops) {
+    DirEntry *item = &frame->items[i];
+    int hops;
+    if (item->prune == PRUNE_UNKNOWN &&
+        !should_descend(walk->config, item, depth, link_hops, &hops)) {
+        item->prune = PRUNE_SHOWN;
+    }
+    if (item->prune != PRUNE_UNKNOWN) {
+        return item->prune == PRUNE_SHOWN;
+    }
+    
+    ArenaMark before = arena_mark(&walk->arena);
+    int ancestors = walk->ancestors.depth;
+    KeptFrame *kept = (KeptFrame *)arena_alloc(&walk->arena, sizeof(KeptFrame));
+    if (!kept) {
+        walk_out_of_memory(walk);
+        return false;
+    }
+    kept->frame.have_id = false;
+    if (!open_child_frame(walk, frame, item, &kept->frame)) {
+        bool empty = kept->frame.have_id && is_empty_dir(walk, kept->frame.id);
+        arena_release(&walk->arena, before);
+        item->prune = empty ? PRUNE_EMPTY : PRUNE_SHOWN;
+        return !empty;
+    }
+    if (last_shown_entry(walk, &kept->frame, depth + 1, hops) < 0) {
+        if (kept->frame.have_id) {
+            note_empty_dir(walk, kept->frame.id);
+        }
+        close_frame(walk, &kept->frame);
+        arena_release(&walk->arena, before);
+        item->prune = PRUNE_EMPTY;
+        return false;
+    }
+    
+    // Off the ancestor stack until it is taken, with whatever was kept
+    // below it, so its siblings are walked as they would be without it
+    walk->ancestors.depth = ancestors;
+    kept->index = i;
+    kept->link_hops = hops;
+    kept->taken = false;
+    kept->next = frame->kept;
+    frame->kept = kept;
+    item->prune = PRUNE_SHOWN;
+    return true;
+}
+
+// Find the last entry of an open directory that prune_empty shows, or -1
+// if there is none. Files are always shown; the directories after the
+// last one are probed from the end. Searching backward means the only
+// subdirectory left open is the one printed last, so those opened later
+// for earlier entries are closed first and the arena stays a stack.
+static int last_shown_entry(TreeWalk *walk, DirFrame *frame, int depth, int link_hops) {
+    // The summary line of a capped listing comes last, and always shows
+    if (frame->rest.files + frame->rest.dirs > 0) {
+        return frame->count;
+    }
+    int i = frame->count - 1;
+    while (i >= 0 && frame->items[i].is_dir && !walk_failed(walk) &&
+           !probe_directory(walk, frame, i, depth, link_hops)) {
+        i--;
+    }
+    return walk_failed(walk) ? -1 : i;
+}
+
+// Take the subdirectory entry i of frame that probe_directory kept open,
+// putting it back on the ancestor stack. Returns false if it isn't kept
+// (it is a leaf) or the walk failed.
+static bool take_kept_frame(TreeWalk *walk, DirFrame *frame, int i, DirFrame *child, int *hops) {
+    KeptFrame *kept = frame->kept;
+    while (kept && kept->index != i) {
+        kept = kept->next;
+    }
+    if (!kept || walk_failed(walk)) {
+        return false;
+    }
+    kept->taken = true;
+    *child = kept->frame;
+    *hops = kept->link_hops;
+    if (child->have_id && walk->config->cycle_policy == DIRTREE_CYCLES_ANCESTORS &&
+        !push_ancestor(&walk->ancestors, child->id)) {
+        walk_out_of_memory(walk);
+        child->have_id = false;
+        close_frame(walk, child);
+        return false;
+    }
+    return true;
+}
+
+// Print an open directory like print_tree_to_buffer, leaving out the
+// subdirectories with nothing shown below them, then close it. Before an
+// entry is printed the walk must know it is shown and whether a later one
+// is, so the last shown entry is found first (which the probe of this
+// directory usually already did) and the other directories are looked
+// into just ahead of their line. Each stays open until printed, which
+// bounds the lookahead to one chain of directories down to a file.
+static bool print_pruned_tree(TreeWalk *walk, DirFrame *frame, int current_depth, int link_hops) {
+    DirEntry *items = frame->items;
+    int last_shown = last_shown_entry(walk, frame, current_depth, link_hops);
+    bool running = true;
+    
+    for (int i = 0; i < frame->count && i <= last_shown && running && !walk_failed(walk); i++) {
+        if (items[i].is_dir && !probe_directory(walk, frame, i, current_depth, link_hops)) {
+            continue;
+        }
+        if (walk->budgeted && !within_budget(walk, items[i].name_len)) {
+            running = false;
+            break;
+        }
+        bool is_last = (i == last_shown);
+        append_entry_line(walk, &items[i], is_last);
+        
+        int hops;
+        DirFrame child;
+        if (items[i].is_dir && take_kept_frame(walk, frame, i, &child, &hops)) {
+            size_t saved = push_prefix(walk, is_last);
+            running = print_pruned_tree(walk, &child, current_depth + 1, hops);
+            walk->prefix_len = saved;
+        }
+    }
+    if (last_shown == frame->count && running && !walk_failed(walk)) {
+        running = append_rest_line(walk, &frame->rest);
+    }
+    
+    close_frame(walk, frame);
+    return running;
+}
+
+// Print an open directory and everything below it to the string buffer,
+// or hand each entry to the walk's visitor instead, then close it.
+// Children are opened relative to the parent's descriptor so every lookup
+// resolves a single path component. Returns false if the visitor stopped
+// the walk; a failed walk unwinds with walk->error set.
+static bool print_tree_to_buffer(TreeWalk *walk, DirFrame *frame, int current_depth, int link_hops) {
+    const DirtreeConfig *config = walk->config;
+    DirEntry *items = frame->items;
+    int count = frame->count;
+    bool running = true;
+    
+    if (config->prune_empty && !walk->visitor) {
+        return print_pruned_tree(walk, frame, current_depth, link_hops);
+    }
+    
+    // Process each item; a capped listing ends with its summary line
+    bool has_rest = frame->rest.files + frame->rest.dirs > 0;
+    for (int i = 0; i < count && running && !walk_failed(walk); i++) {
+        bool is_last = (i == count - 1) && !has_rest;
+        bool descend = true;
+        if (walk->visitor) {
+            DirtreeEntry entry;
+            fill_entry(walk, frame, &items[i], current_depth, is_last, &entry);
+            DirtreeWalkAction action = walk->visitor(&entry, walk->userdata);
+            if (action == DIRTREE_WALK_STOP) {
+                running = false;
+                break;
+            }
+            descend = (action != DIRTREE_WALK_SKIP_SUBTREE);
+        } else if (walk->budgeted && !within_budget(walk, items[i].name_len)) {
+            running = false;
+            break;
+        } else {
+            append_entry_line(walk, &items[i], is_last);
+        }
+        
+        // Recursively process directories, unless the visitor pruned them
+        int hops;
+        DirFrame child;
+        if (descend && should_descend(config, &items[i], current_depth, link_hops, &hops) &&
+            open_child_frame(walk, frame, &items[i], &child)) {
+            size_t saved = push_prefix(walk, is_last);
+            running = print_tree_to_buffer(walk, &child, current_depth + 1, hops);
+            walk->prefix_len = saved;
+        }
+    }
+    if (has_rest && running && !walk_failed(walk)) {
+        running = append_rest_line(walk, &frame->rest);
+    }
+    
+    close_frame(walk, frame);
+    return running;
+}
+
+// Snapshot being built by dirtree_index_save
+typedef struct {
+    IndexNode *nodes;
+    size_t count;
+    size_t capacity;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+} IndexBuilder;
+
+// Append a node for name below parent and store its index in node.
+// Returns false, failing the walk, if out of memory or past the format's
+// 32-bit limits.
+static bool index_add_node(TreeWalk *walk, IndexBuilder *builder, uint32_t parent,
+                           const char *name, size_t name_len, uint32_t flags, uint32_t *node) {
+    if (builder->count >= UINT32_MAX || builder->strings_size + name_len + 1 > UINT32_MAX) {
+        record_error(&walk->error, DIRTREE_ERR_FORMAT, ERANGE, NULL);
+        return false;
+    }
+    
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity ? builder->capacity * 2 : 1024;
+        IndexNode *nodes = (IndexNode *)realloc(builder->nodes, capacity * sizeof(IndexNode));
+        if (!nodes) {
+            walk_out_of_memory(walk);
+            return false;
+        }
+        builder->nodes = nodes;
+        builder->capacity = capacity;
+    }
+    if (builder->strings_size + name_len + 1 > builder->strings_capacity) {
+        size_t capacity = builder->strings_capacity ? builder->strings_capacity * 2 : 16384;
+        while (capacity < builder->strings_size + name_len + 1) {
+            capacity *= 2;
+        }
+        char *strings = (char *)realloc(builder->strings, capacity);
+        if (!strings) {
+            walk_out_of_memory(walk);
+            return false;
+        }
+        builder->strings = strings;
+        builder->strings_capacity = capacity;
+    }
+    
+    IndexNode *entry = &builder->nodes[builder->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = (uint32_t)builder->strings_size;
+    entry->name_len = (uint32_t)name_len;
+    entry->parent = parent;
+    entry->end = (uint32_t)builder->count + 1;
+    entry->flags = flags;
+    memcpy(builder->strings + builder->strings_size, name, name_len);
+    builder->strings[builder->strings_size + name_len] = '\0';
+    builder->strings_size += name_len + 1;
+    *node = (uint32_t)builder->count++;
+    return true;
+}
+
+// Record an entry's size and mtime in its node
+static void index_entry_metadata(TreeWalk *walk, const DirFrame *frame, const DirEntry *item,
+                                 IndexNode *node) {
+    // A watch would have named a settled directory had an entry changed
+    if (walk->index || frame->settled) {
+        const IndexNode *source = walk->index ? &walk->index->nodes[item->node] :
+                                                &walk->baseline->nodes[item->node];
+        node->size = source->size;
+        node->mtime = source->mtime;
+        node->flags |= source->flags & INDEX_NODE_METADATA;
+        return;
+    }
+#ifdef _WIN32
+    (void)frame;
+    (void)item;
+#else
+    struct stat st;
+    if (stat_listed_entry(walk, frame, item, &st)) {
+        node->size = (uint64_t)st.st_size;
+        node->mtime = STAT_TIME_NS(st, m);
+        node->flags |= INDEX_NODE_METADATA;
+    }
+#endif
+}
+
+// Record the timestamps and identity of an opened directory, so a later
+// scan can tell whether it changed, and whether its listing dropped
+// symlinks. source is its node in the snapshot being walked, or in the
+// baseline for a settled directory.
+static void index_stamp_directory(TreeWalk *walk, const DirFrame *frame, uint32_t source,
+                                  IndexNode *node) {
+    if (frame->links_dropped) {
+        node->flags |= INDEX_NODE_LINKS_DROPPED;
+    }
+    if (walk->index || frame->settled) {
+        const IndexNode *from = walk->index ? &walk->index->nodes[source] :
+                                              &walk->baseline->nodes[source];
+        node->mtime = from->mtime;
+        node->ctime = from->ctime;
+        node->ino = from->ino;
+        node->dev = from->dev;
+        node->flags |= from->flags & INDEX_NODE_STAMPED;
+        return;
+    }
+#ifdef _WIN32
+    (void)frame;
+#else
+    struct stat st;
+    int dir_fd = held_dir_fd(walk, frame->held);
+    if (dir_fd >= 0 && fstat(dir_fd, &st) == 0) {
+        node->mtime = STAT_TIME_NS(st, m);
+        node->ctime = STAT_TIME_NS(st, c);
+        node->ino = (uint64_t)st.st_ino;
+        node->dev = (uint64_t)st.st_dev;
+        node->flags |= INDEX_NODE_STAMPED;
+    }
+#endif
+}
+
+// Add the entries of an open directory and everything below it to a
+// snapshot under node parent, in the order they would be printed, then
+// close the directory
+static void index_directory(TreeWalk *walk, IndexBuilder *builder, DirFrame *frame,
+                            uint32_t parent, int current_depth, int link_hops) {
+    const DirtreeConfig *config = walk->config;
+    
+    for (int i = 0; i < frame->count && !walk_failed(walk); i++) {
+        const DirEntry *item = &frame->items[i];
+        uint32_t flags = (item->is_dir ? INDEX_NODE_DIR : 0) | (item->is_link ? INDEX_NODE_LINK : 0);
+        uint32_t node;
+        if (!index_add_node(walk, builder, parent, item->name, item->name_len, flags, &node)) {
+            break;
+        }
+        if (config->collect_metadata) {
+            index_entry_metadata(walk, frame, item, &builder->nodes[node]);
+        }
+        
+        // The node array may move while the subtree is added
+        int hops;
+        DirFrame child;
+        if (should_descend(config, item, current_depth, link_hops, &hops) &&
+            open_child_frame(walk, frame, item, &child)) {
+            index_stamp_directory(walk, &child, item->node, &builder->nodes[node]);
+            builder->nodes[node].flags |= INDEX_NODE_LISTED;
+            index_directory(walk, builder, &child, node, current_depth + 1, hops);
+        }
+        builder->nodes[node].end = (uint32_t)builder->count;
+    }
+    
+    close_frame(walk, frame);
+}
+
+#ifdef DIRTREE_HAVE_THREADS
+// Listing of one directory scanned by the worker pool, kept until the
+// whole tree is rendered
+typedef struct DirNode {
+    DirEntry *items;             // Sorted entries
+    struct DirNode **children;   // Listing of items[i], NULL when not scanned
+    struct DirNode *parent;
+    DirId id;
+    bool have_id;                // id could be read; unidentified nodes are never deduplicated
+    bool cycle;                  // Cut by the scan as a cycle back to an ancestor; never listed
+    IgnoreScope scope;           // Ignore files in force for the listing
+    int count;
+    ListingRest rest;            // Entries past max_children_per_dir
+    DirReader reader;            // Kept open until every child has opened itself
+    int open_refs;               // Children still needing the descriptor
+} DirNode;
+
+// One directory waiting to be scanned
+typedef struct {
+    DirNode *parent;             // NULL for the root
+    int index;                   // Entry of parent to scan
+    int fd;                      // Root only: its already-open descriptor
+    int depth;
+    int link_hops;
+} ScanTask;
+
+// Per-worker task deque: the owner pushes and pops at the tail (depth
+// first, warm caches), idle workers steal the oldest tasks from the head
+typedef struct {
+    pthread_mutex_t lock;
+    ScanTask *tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} TaskDeque;
+
+typedef struct {
+    const DirtreeConfig *config;
+    DirNode *root;
+    TaskDeque *deques;
+    int workers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    long pending;                // Tasks queued or running
+    long queued;                 // Tasks sitting in a deque
+    long sleepers;               // Workers blocked on idle_cond
+    int failed;                  // Set once a worker fails; remaining tasks are dropped
+    pthread_mutex_t seen_lock;
+    VisitedDirs seen;            // Directories scanned so far (DIRTREE_CYCLES_VISITED only)
+    size_t repeats;              // Directories scanned again, reached through another link
+    bool gave_up;                // Too many repeats or out of descriptors: walk serially instead
+} ScanPool;
+
+typedef struct {
+    ScanPool *pool;
+    int id;
+    TreeWalk walk;
+    DirtreeStats stats;
+} ScanWorker;
+
+// Queue a task on a worker's own deque and wake an idle worker. Returns
+// false if the deque can't grow; the task is then not queued.
+static bool scan_pool_push(ScanPool *pool, int id, const ScanTask *task) {
+    TaskDeque *deque = &pool->deques[id];
+    
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            // Reclaim the space left by stolen tasks
+            memmove(deque->tasks, deque->tasks + deque->head,
+                    (deque->tail - deque->head) * sizeof(ScanTask));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            ScanTask *tasks = (ScanTask *)realloc(deque->tasks, capacity * sizeof(ScanTask));
+            if (!tasks) {
+                // The pushing task itself is still pending, so this can't wake the pool
+                pthread_mutex_unlock(&deque->lock);
+                __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+                return false;
+            }
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->tail++] = *task;
+    pthread_mutex_unlock(&deque->lock);
+    
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return true;
+}
+
+// Take the newest task from our own deque, or steal the oldest from another
+static bool scan_pool_take(ScanPool *pool, int id, ScanTask *task) {
+    for (int k = 0; k < pool->workers; k++) {
+        int victim = (id + k) % pool->workers;
+        TaskDeque *deque = &pool->deques[victim];
+        bool found = false;
+        
+        pthread_mutex_lock(&deque->lock);
+        if (deque->tail > deque->head) {
+            if (k == 0) {
+                *task = deque->tasks[--deque->tail];
+            } else {
+                *task = deque->tasks[deque->head++];
+            }
+            if (deque->head == deque->tail) {
+                deque->head = deque->tail = 0;
+            }
+            found = true;
+        }
+        pthread_mutex_unlock(&deque->lock);
+        
+        if (found) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drop one child's claim on a directory descriptor, closing it after the last
+static void release_node_fd(DirNode *node) {
+    if (__atomic_sub_fetch(&node->open_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        dir_reader_close(&node->reader);
+    }
+}
+
+// Check whether a directory is already being scanned further up its branch
+static bool is_scanned_ancestor(const DirNode *node, DirId id) {
+    for (; node; node = node->parent) {
+        if (node->have_id && node->id.dev == id.dev && node->id.ino == id.ino) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Count a directory about to be scanned under the visited policy. The
+// scan reads a directory once per path reaching it, which grows
+// exponentially on trees linking back into themselves, so once repeats
+// outnumber the distinct directories the pool gives up and the caller
+// walks the tree serially, reading each directory once. Returns false
+// when the scan must stop.
+static bool count_scanned_dir(ScanPool *pool, TreeWalk *walk, DirId id) {
+    pthread_mutex_lock(&pool->seen_lock);
+    int marked = mark_visited(&pool->seen, id);
+    if (marked == 0 && ++pool->repeats > pool->seen.size) {
+        pool->gave_up = true;
+    }
+    bool stop = marked < 0 || pool->gave_up;
+    pthread_mutex_unlock(&pool->seen_lock);
+    
+    if (marked < 0) {
+        walk_out_of_memory(walk);
+    }
+    if (stop) {
+        __atomic_store_n(&pool->failed, 1, __ATOMIC_SEQ_CST);
+    }
+    return !stop;
+}
+
+// Stop the scan once a worker's walk failed. Running out of descriptors,
+// which every directory still waiting on its children holds one of, only
+// gives up: the serial walk caps how many it keeps open.
+static void stop_failed_scan(ScanPool *pool, const TreeWalk *walk) {
+    if (!walk_failed(walk)) {
+        return;
+    }
+    if (out_of_descriptors(walk->error.sys_errno)) {
+        pthread_mutex_lock(&pool->seen_lock);
+        pool->gave_up = true;
+        pthread_mutex_unlock(&pool->seen_lock);
+    }
+    __atomic_store_n(&pool->failed, 1, __ATOMIC_SEQ_CST);
+}
+
+// Scan one directory: list and sort it, then queue its subdirectories
+static void run_scan_task(ScanWorker *worker, const ScanTask *task) {
+    ScanPool *pool = worker->pool;
+    const DirtreeConfig *config = pool->config;
+    TreeWalk *walk = &worker->walk;
+    int fd = task->fd;
+    
+    if (__atomic_load_n(&pool->failed, __ATOMIC_SEQ_CST)) {
+        if (task->parent) {
+            release_node_fd(task->parent);
+        } else {
+            close(fd);
+        }
+        return;
+    }
+    
+    if (task->parent) {
+        const DirEntry *item = &task->parent->items[task->index];
+        fd = open_child_dir(task->parent->reader.fd, item);
+        int open_errno = errno;
+        release_node_fd(task->parent);
+        if (fd < 0) {
+            note_unreadable_child(walk, open_errno, &task->parent->scope, item->name);
+            stop_failed_scan(pool, walk);
+            return;
+        }
+    }
+    
+    // Nodes and listings live in the worker's arena until the walk ends
+    Arena *arena = &walk->arena;
+    ArenaMark mark = arena_mark(arena);
+    DirNode *node = (DirNode *)arena_alloc(arena, sizeof(DirNode));
+    if (!node) {
+        close(fd);
+        walk_out_of_memory(walk);
+        __atomic_store_n(&pool->failed, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    memset(node, 0, sizeof(DirNode));
+    node->parent = task->parent;
+    struct stat st;
+    node->have_id = stat_dir_fd(fd, &st, &node->id);
+    
+    // Workers can't share one visited set without making the output depend
+    // on scheduling, so the scan only stops at cycles back to an ancestor.
+    // Repeats elsewhere are dropped when rendering, in the serial order.
+    if (node->have_id && is_scanned_ancestor(task->parent, node->id)) {
+        close(fd);
+        node->cycle = true;
+        task->parent->children[task->index] = node;
+        return;
+    }
+    if (node->have_id && config->cycle_policy == DIRTREE_CYCLES_VISITED &&
+        !count_scanned_dir(pool, walk, node->id)) {
+        close(fd);
+        arena_release(arena, mark);
+        return;
+    }
+    
+    const DirEntry *item = task->parent ? &task->parent->items[task->index] : NULL;
+    uint32_t baseline_node = item ? item->node : walk->baseline ? 0 : INDEX_NONE;
+    if (enter_ignore_scope(walk, task->parent ? &task->parent->scope : NULL,
+                           item ? item->name : NULL, &node->scope)) {
+        node->items = list_directory(walk, fd, node->have_id ? &st : NULL, baseline_node,
+                                     item ? item->name : NULL, &node->scope, &node->reader,
+                                     &node->count, &node->rest);
+    } else {
+        close(fd);
+    }
+    if (node->items) {
+        node->children = (DirNode **)arena_alloc(arena, node->count * sizeof(DirNode *));
+        if (!node->children) {
+            dir_reader_close(&node->reader);
+            walk_out_of_memory(walk);
+        }
+    }
+    if (!node->items || !node->children) {
+        arena_release(arena, mark);
+        stop_failed_scan(pool, walk);
+        return;
+    }
+    if (node->count > 0) {
+        memset(node->children, 0, node->count * sizeof(DirNode *));
+    }
+    
+    // Settle the descriptor's reference count before any child can run
+    int refs = 0;
+    int hops;
+    for (int i = 0; i < node->count; i++) {
+        refs += should_descend(config, &node->items[i], task->depth, task->link_hops, &hops);
+    }
+    node->open_refs = refs;
+    
+    if (task->parent) {
+        task->parent->children[task->index] = node;
+    } else {
+        pool->root = node;
+    }
+    
+    if (refs == 0) {
+        dir_reader_close(&node->reader);
+        return;
+    }
+    
+    // Queue in reverse so the owner pops the first child next. A child
+    // that can't be queued gives back its claim on the descriptor.
+    for (int i = node->count - 1; i >= 0; i--) {
+        if (should_descend(config, &node->items[i], task->depth, task->link_hops, &hops)) {
+            ScanTask child = { node, i, -1, task->depth + 1, hops };
+            if (!scan_pool_push(pool, worker->id, &child)) {
+                walk_out_of_memory(walk);
+                __atomic_store_n(&pool->failed, 1, __ATOMIC_SEQ_CST);
+                release_node_fd(node);
+            }
+        }
+    }
+}
+
+// Worker loop: run tasks until none are queued or running anywhere
+static void *scan_worker_main(void *arg) {
+    ScanWorker *worker = (ScanWorker *)arg;
+    ScanPool *pool = worker->pool;
+    ScanTask task;
+    
+    for (;;) {
+        if (scan_pool_take(pool, worker->id, &task)) {
+            run_scan_task(worker, &task);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+        
+        pthread_mutex_lock(&pool->idle_lock);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0 &&
+               __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        bool finished = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        
+        if (finished) {
+            return NULL;
+        }
+    }
+}
+
+// Render a scanned listing exactly as print_tree_to_buffer would,
+// including its visited-directory checks
+static void render_scanned_tree(TreeWalk *walk, const DirNode *node) {
+    bool has_rest = node->rest.files + node->rest.dirs > 0;
+    for (int i = 0; i < node->count && !walk_failed(walk); i++) {
+        bool is_last = (i == node->count - 1) && !has_rest;
+        append_entry_line(walk, &node->items[i], is_last);
+        
+        // Cycles were already cut during the scan; the visited policy also
+        // drops repeats reached through other links
+        const DirNode *child = node->children[i];
+        bool repeat = child && child->cycle;
+        if (!repeat && child && child->have_id &&
+            walk->config->cycle_policy == DIRTREE_CYCLES_VISITED) {
+            int marked = mark_visited(&walk->visited, child->id);
+            if (marked < 0) {
+                walk_out_of_memory(walk);
+                return;
+            }
+            repeat = (marked == 0);
+        }
+        walk->error.dirs_skipped += repeat;
+        if (child && !repeat) {
+            size_t saved = push_prefix(walk, is_last);
+            render_scanned_tree(walk, child);
+            walk->prefix_len = saved;
+        }
+    }
+    if (has_rest && !walk_failed(walk)) {
+        append_rest_line(walk, &node->rest);
+    }
+}
+
+static int last_shown_scanned(TreeWalk *walk, DirNode *node);
+
+// Find out, like probe_directory, whether prune_empty shows the scanned
+// directory entry i of node. Repeats are cut here instead of by the
+// rendering, in the order a serial walk meets them, and left unlisted;
+// those of a directory already left out are left out too.
+static bool probe_scanned_directory(TreeWalk *walk, DirNode *node, int i) {
+    DirEntry *item = &node->items[i];
+    if (item->prune != PRUNE_UNKNOWN) {
+        return item->prune == PRUNE_SHOWN;
+    }
+    
+    DirNode *child = node->children[i];
+    bool repeat = child && child->cycle;
+    if (!repeat && child && child->have_id &&
+        walk->config->cycle_policy == DIRTREE_CYCLES_VISITED) {
+        int marked = mark_visited(&walk->visited, child->id);
+        if (marked < 0) {
+            walk_out_of_memory(walk);
+            return false;
+        }
+        repeat = (marked == 0);
+    }
+    walk->error.dirs_skipped += repeat;
+    if (repeat) {
+        node->children[i] = NULL;
+    }
+    
+    bool shown;
+    if (repeat) {
+        shown = !(child->have_id && is_empty_dir(walk, child->id));
+    } else {
+        shown = !child || last_shown_scanned(walk, child) >= 0;
+        if (!shown && child->have_id) {
+            note_empty_dir(walk, child->id);
+        }
+    }
+    item->prune = shown ? PRUNE_SHOWN : PRUNE_EMPTY;
+    return shown;
+}
+
+// Find the last entry of a scanned listing that prune_empty shows, as
+// last_shown_entry does
+static int last_shown_scanned(TreeWalk *walk, DirNode *node) {
+    if (node->rest.files + node->rest.dirs > 0) {
+        return node->count;
+    }
+    int i = node->count - 1;
+    while (i >= 0 && node->items[i].is_dir && !walk_failed(walk) &&
+           !probe_scanned_directory(walk, node, i)) {
+        i--;
+    }
+    return walk_failed(walk) ? -1 : i;
+}
+
+// Render a scanned listing as print_pruned_tree would
+static void render_pruned_scanned_tree(TreeWalk *walk, DirNode *node) {
+    DirEntry *items = node->items;
+    int last_shown = last_shown_scanned(walk, node);
+    
+    for (int i = 0; i < node->count && i <= last_shown && !walk_failed(walk); i++) {
+        if (items[i].is_dir && !probe_scanned_directory(walk, node, i)) {
+            continue;
+        }
+        bool is_last = (i == last_shown);
+        append_entry_line(walk, &items[i], is_last);
+        if (node->children[i]) {
+            size_t saved = push_prefix(walk, is_last);
+            render_pruned_scanned_tree(walk, node->children[i]);
+            walk->prefix_len = saved;
+        }
+    }
+    if (last_shown == node->count && !walk_failed(walk)) {
+        append_rest_line(walk, &node->rest);
+    }
+}
+
+// Scan the tree below root_fd on config->threads workers, then render the
+// collected listings in order. The calling thread is worker 0, so the scan
+// completes even if no extra thread can be started. Returns false, with
+// nothing rendered, if the scan gave up on repeats (see count_scanned_dir)
+// and the tree must be walked serially.
+static bool print_tree_parallel(TreeWalk *walk, int root_fd) {
+    const DirtreeConfig *config = walk->config;
+    ScanPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.config = config;
+    pool.workers = config->threads;
+    
+    pool.deques = (TaskDeque *)calloc(pool.workers, sizeof(TaskDeque));
+    ScanWorker *workers = (ScanWorker *)calloc(pool.workers, sizeof(ScanWorker));
+    pthread_t *threads = (pthread_t *)calloc(pool.workers, sizeof(pthread_t));
+    bool *started = (bool *)calloc(pool.workers, sizeof(bool));
+    bool ready = config->cycle_policy != DIRTREE_CYCLES_VISITED || init_visited_dirs(&pool.seen, 256);
+    if (!pool.deques || !workers || !threads || !started || !ready) {
+        walk_out_of_memory(walk);
+        close(root_fd);
+        free_visited_dirs(&pool.seen);
+        free(started);
+        free(threads);
+        free(workers);
+        free(pool.deques);
+        return true;
+    }
+    
+    pthread_mutex_init(&pool.seen_lock, NULL);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    for (int i = 0; i < pool.workers; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        ready = init_tree_walk(&workers[i].walk, config, walk->skip, NULL,
+                               walk->stats ? &workers[i].stats : NULL) && ready;
+        workers[i].walk.child_cap = walk->child_cap;
+        workers[i].walk.baseline = walk->baseline;
+        workers[i].walk.baseline_trusted = walk->baseline_trusted;
+    }
+    
+    ScanTask root = { NULL, 0, root_fd, 1, 0 };
+    if (!ready || !scan_pool_push(&pool, 0, &root)) {
+        walk_out_of_memory(walk);
+        close(root_fd);
+    } else {
+        for (int i = 1; i < pool.workers; i++) {
+            started[i] = pthread_create(&threads[i], NULL, scan_worker_main, &workers[i]) == 0;
+        }
+        scan_worker_main(&workers[0]);
+        for (int i = 1; i < pool.workers; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+    }
+    
+    // An abandoned scan leaves no trace: the serial walk counts everything
+    for (int i = 0; i < pool.workers; i++) {
+        if (walk->stats && !pool.gave_up) {
+            walk->stats->entries_scanned += workers[i].stats.entries_scanned;
+            walk->stats->stat_calls += workers[i].stats.stat_calls;
+            walk->stats->stats_avoided += workers[i].stats.stats_avoided;
+            walk->stats->stats_batched += workers[i].stats.stats_batched;
+            walk->stats->dirs_reused += workers[i].stats.dirs_reused;
+        }
+        if (!pool.gave_up) {
+            merge_error(&walk->error, &workers[i].walk.error);
+        }
+        free(pool.deques[i].tasks);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    
+    if (pool.root && !pool.gave_up && !walk_failed(walk)) {
+        if (pool.root->have_id && config->cycle_policy == DIRTREE_CYCLES_VISITED) {
+            mark_visited(&walk->visited, pool.root->id);
+        }
+        if (config->prune_empty) {
+            render_pruned_scanned_tree(walk, pool.root);
+        } else {
+            render_scanned_tree(walk, pool.root);
+        }
+    }
+    
+    // The listings are spread over the workers' arenas
+    for (int i = 0; i < pool.workers; i++) {
+        release_tree_walk(&workers[i].walk);
+    }
+    
+    free_visited_dirs(&pool.seen);
+    free(started);
+    free(threads);
+    free(workers);
+    free(pool.deques);
+    pthread_cond_destroy(&pool.idle_cond);
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_mutex_destroy(&pool.seen_lock);
+    return !pool.gave_up;
+}
+#endif
+
+// Initialize the default configuration
+void dirtree_init_config(DirtreeConfig *config) {
+    if (!config) return;
+    
+    config->max_depth = -1;  // No limit by default
+    config->skip_hidden = true;
+    config->skip_common = true;
+    
+    // Use Unicode by default, fallback to ASCII on Windows
+#ifdef _WIN32
+    config->format = DIRTREE_FORMAT_ASCII;
+#else
+    config->format = DIRTREE_FORMAT_UNICODE;
+#endif
+    
+    config->custom_skip_dirs = NULL;
+    config->custom_skip_files = NULL;
+    config->use_dtype = true;
+    config->stats = NULL;
+    config->dirent_buffer_size = 0;
+    config->use_io_uring = false;
+    config->threads = 1;
+    config->cycle_policy = DIRTREE_CYCLES_VISITED;
+    config->output_size_hint = 0;
+    config->collect_metadata = false;
+    config->error = NULL;
+    config->index = NULL;
+    config->baseline = NULL;
+    config->watch_debounce_ms = 200;
+    config->use_ignore_files = false;
+    config->prune_empty = false;
+    config->max_entries = 0;
+    config->max_output_bytes = 0;
+    config->max_time_ms = 0;
+    config->max_children_per_dir = 0;
+    config->include_patterns = NULL;
+    config->include_extensions = NULL;
+    config->exclude_patterns = NULL;
+}
+
+// Free a NULL-terminated list of names and reset it
+static void free_name_list(char ***list) {
+    if (*list) {
+        for (int i = 0; (*list)[i] != NULL; i++) {
+            free((*list)[i]);
+        }
+        free(*list);
+        *list = NULL;
+    }
+}
+
+// Append a copy of name to a NULL-terminated list, which is left
+// unchanged if memory runs out. Returns 0 or -1.
+static int append_name(char ***list, const char *name) {
     int count = 0;
-    int capacity = 10;
-    DirEntry *items = (DirEntry *)malloc(capacity * sizeof(DirEntry));
-    if (!items) {
-        perror("Memory allocation failed");
-        FindClose(hFind);
-        exit(EXIT_FAILURE);
+    if (*list) {
+        // Count existing entries
+        while ((*list)[count] != NULL) {
+            count++;
+        }
+    }
+    
+    char *copy = (char *)strdup(name);
+    if (!copy) {
+        return -1;
+    }
+    
+    // Allocate or reallocate the array
+    char **names = (char **)realloc(*list, (count + 2) * sizeof(char *));
+    if (!names) {
+        free(copy);
+        return -1;
+    }
+    
+    // Add the new entry and NULL terminator
+    *list = names;
+    names[count] = copy;
+    names[count + 1] = NULL;
+    return 0;
+}
+
+// Free resources allocated for the configuration
+void dirtree_free_config(DirtreeConfig *config) {
+    if (!config) return;
+    
+    free_name_list(&config->custom_skip_dirs);
+    free_name_list(&config->custom_skip_files);
+    free_name_list(&config->include_patterns);
+    free_name_list(&config->include_extensions);
+    free_name_list(&config->exclude_patterns);
+}
+
+// Add custom directory to skip
+int dirtree_add_skip_dir(DirtreeConfig *config, const char *dirname) {
+    if (!config || !dirname) return -1;
+    return append_name(&config->custom_skip_dirs, dirname);
+}
+
+// Add custom file to skip
+int dirtree_add_skip_file(DirtreeConfig *config, const char *filename) {
+    if (!config || !filename) return -1;
+    return append_name(&config->custom_skip_files, filename);
+}
+
+// Add a glob that files must match
+int dirtree_add_include(DirtreeConfig *config, const char *pattern) {
+    if (!config || !pattern) return -1;
+    return append_name(&config->include_patterns, pattern);
+}
+
+// Add a file extension to keep
+int dirtree_add_extension(DirtreeConfig *config, const char *extension) {
+    if (!config || !extension) return -1;
+    return append_name(&config->include_extensions, extension);
+}
+
+// Add a glob of entries to leave out
+int dirtree_add_exclude(DirtreeConfig *config, const char *pattern) {
+    if (!config || !pattern) return -1;
+    return append_name(&config->exclude_patterns, pattern);
+}
+
+// Print the name of the root directory as the first line
+static void write_root_line(TreeWalk *walk, const char *abs_dir) {
+    // Extract and print the root directory name
+    const char *base_name;
+    
+#ifdef _WIN32
+    base_name = strrchr(abs_dir, '\\');
+#else
+    base_name = strrchr(abs_dir, '/');
+#endif
+    
+    if (base_name == NULL) {
+        base_name = abs_dir;
+    } else {
+        base_name++;  // Skip the separator
+    }
+    
+    size_t base_len = strlen(base_name);
+    char *line = string_buffer_reserve(walk->sb, base_len + 1);
+    if (!line) {
+        record_error(&walk->error, walk->sb->error, walk->sb->sys_errno, NULL);
+        return;
+    }
+    memcpy(line, base_name, base_len);
+    line[base_len] = '\n';
+    string_buffer_commit(walk->sb, base_len + 1);
+}
+
+// Absolute path of a walk's root: the directory the loaded snapshot was
+// saved from, or dirpath resolved. NULL, failing the walk, on error.
+static char *resolve_root(TreeWalk *walk, const char *dirpath) {
+    if (!walk->index) {
+        return get_absolute_path(dirpath, &walk->error);
+    }
+    
+    char *abs_dir = (char *)strdup(walk->index->strings + walk->index->nodes[0].name);
+    if (!abs_dir) {
+        walk_out_of_memory(walk);
+    }
+    return abs_dir;
+}
+
+// Let the walk reuse listings from config->baseline if it was saved from
+// the same root with the same rules
+static void attach_baseline(TreeWalk *walk, const char *abs_dir) {
+    const DirtreeIndex *baseline = walk->config->baseline;
+    // Editing an ignore file changes what its directory's subtree lists
+    // without touching the stamps of the directories below, so listings
+    // can't be vouched for
+    if (!baseline || walk->index || walk->use_ignore_files ||
+        strcmp(baseline->strings + baseline->nodes[0].name, abs_dir) != 0 ||
+        baseline->header->rules != rules_fingerprint(walk->config)) {
+        return;
+    }
+    walk->baseline = baseline;
+    walk->baseline_trusted = baseline->header->scan_started - BASELINE_RACY_NS;
+}
+
+// Walk the tree below dirpath. Entries are either rendered into sb, which
+// collects or streams them, handed to visitor, or added to builder.
+// settled, when a watch rescans, holds the directories it saw no change
+// in since config->baseline was scanned (NULL otherwise). Returns -1 on
+// failure, 1 if the visitor stopped the walk and 0 otherwise; the outcome
+// goes to config->error.
+static int walk_tree(const char *dirpath, const DirtreeConfig *config, StringBuffer *sb,
+                     DirtreeVisitor visitor, void *userdata, IndexBuilder *builder,
+                     const VisitedDirs *settled) {
+    // Reset traversal counters
+    if (config->stats) {
+        memset(config->stats, 0, sizeof(*config->stats));
+    }
+    
+    // Set up the traversal state
+    SkipMatcher skip;
+    TreeWalk walk;
+    bool ready = compile_skip_matcher(&skip, config);
+    ready = init_tree_walk(&walk, config, &skip, sb, config->stats) && ready;
+    walk.visitor = visitor;
+    walk.userdata = userdata;
+    if (config->cycle_policy == DIRTREE_CYCLES_VISITED) {
+        ready = init_visited_dirs(&walk.visited, 256) && ready;
+        if (config->prune_empty && sb) {
+            ready = init_visited_dirs(&walk.empty_dirs, 64) && ready;
+        }
+    }
+    
+    // The cap and budgets bound the text only; snapshots and visitors see
+    // everything
+    if (sb) {
+        walk.child_cap = config->max_children_per_dir > 0 ? config->max_children_per_dir : 0;
+    }
+    if (sb && (config->max_entries > 0 || config->max_output_bytes > 0 || config->max_time_ms > 0)) {
+        walk.budgeted = true;
+        if (config->max_entries > 0) {
+            walk.entries_left = config->max_entries;
+        }
+        if (config->max_time_ms > 0) {
+            walk.deadline = monotonic_ns() + (int64_t)config->max_time_ms * 1000000;
+        }
+    }
+    
+    // Convert to an absolute path
+    char *abs_dir = NULL;
+    if (!ready) {
+        walk_out_of_memory(&walk);
+    } else {
+        abs_dir = resolve_root(&walk, dirpath);
+    }
+    if (abs_dir) {
+        attach_baseline(&walk, abs_dir);
+        walk.settled = walk.baseline ? settled : NULL;
+    }
+    
+    if (abs_dir && sb) {
+        write_root_line(&walk, abs_dir);
+    }
+    uint32_t root_node = 0;
+    if (abs_dir && builder) {
+        index_add_node(&walk, builder, 0, abs_dir, strlen(abs_dir), INDEX_NODE_DIR, &root_node);
+    }
+    
+    // Generate the tree
+    bool completed = true;
+    DirFrame root;
+    if (abs_dir && !walk_failed(&walk)) {
+        bool serial = true;
+#ifdef DIRTREE_HAVE_THREADS
+        if (config->threads > 1 && sb && !config->index && !walk.budgeted) {
+            int root_fd = open(abs_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (root_fd < 0) {
+                note_unreadable(&walk, errno, abs_dir);
+                serial = false;
+            } else {
+                serial = !print_tree_parallel(&walk, root_fd);
+            }
+        }
+#endif
+        if (serial && open_root_frame(&walk, abs_dir, &root)) {
+            if (builder) {
+                index_stamp_directory(&walk, &root, 0, &builder->nodes[root_node]);
+                builder->nodes[root_node].flags |= INDEX_NODE_LISTED;
+                index_directory(&walk, builder, &root, root_node, 1, 0);
+                builder->nodes[root_node].end = (uint32_t)builder->count;
+            } else {
+                completed = print_tree_to_buffer(&walk, &root, 1, 0);
+            }
+        }
+    }
+    
+    // A listing cut short after the last line still gets its marker
+    if (walk.truncated && completed && !walk_failed(&walk)) {
+        append_tree_line(&walk, NULL, walk.truncated, strlen(walk.truncated), true);
+        completed = false;
+    }
+    
+    // Streamed output is written out before returning
+    if (sb) {
+        if (sb->out) {
+            string_buffer_flush(sb);
+        }
+        if (sb->error != DIRTREE_OK) {
+            record_error(&walk.error, sb->error, sb->sys_errno, NULL);
+        }
+        if (config->stats) {
+            config->stats->output_bytes = sb->flushed + sb->size;
+        }
+    }
+    
+    int result = walk_failed(&walk) ? -1 : completed ? 0 : 1;
+    walk.error.truncated = (walk.truncated != NULL);
+    report_error(&walk);
+    
+    // Clean up
+    release_tree_walk(&walk);
+    free_visited_dirs(&walk.visited);
+    free_visited_dirs(&walk.empty_dirs);
+    free_skip_matcher(&skip);
+    free(abs_dir);
+    return result;
+}
+
+// Check that a call names a tree to walk: a directory, or a snapshot
+static bool has_root(const char *dirpath, const DirtreeConfig *config) {
+    return config && (dirpath || config->index);
+}
+
+// Generate directory tree as string
+char *dirtree_generate_string(const char *dirpath, DirtreeConfig *config) {
+    if (!has_root(dirpath, config)) {
+        fail_call(config, DIRTREE_ERR_INVALID, EINVAL);
+        return NULL;
+    }
+    
+    // Initialize string buffer. Start with 4KB, or with the caller's size
+    // hint so a large tree is built without repeated grow-and-copy cycles.
+    StringBuffer sb;
+    size_t initial_capacity = 4096;
+    if (config->output_size_hint >= initial_capacity) {
+        initial_capacity = config->output_size_hint + 1;
+    }
+    if (!init_string_buffer(&sb, initial_capacity)) {
+        fail_call(config, DIRTREE_ERR_NOMEM, ENOMEM);
+        return NULL;
+    }
+    
+    if (walk_tree(dirpath, config, &sb, NULL, NULL, NULL, NULL) < 0) {
+        free(string_buffer_release(&sb));
+        return NULL;
+    }
+    
+    // Return the generated string
+    return string_buffer_release(&sb);
+}
+
+// Print directory tree to specified file
+int dirtree_print_to_file(FILE *output, const char *dirpath, DirtreeConfig *config) {
+    if (!output || !has_root(dirpath, config)) {
+        fail_call(config, DIRTREE_ERR_INVALID, EINVAL);
+        return -1;
+    }
+    
+    // Stream lines out as they are produced instead of materializing the
+    // whole tree, so output starts right away and memory stays bounded
+    StringBuffer sb;
+    if (!init_stream_buffer(&sb, output, STREAM_BUFFER_SIZE)) {
+        fail_call(config, DIRTREE_ERR_NOMEM, ENOMEM);
+        return -1;
+    }
+    
+    int result = walk_tree(dirpath, config, &sb, NULL, NULL, NULL, NULL);
+    free(string_buffer_release(&sb));
+    
+    return result < 0 ? -1 : 0;
+}
+
+// Print directory tree to stdout
+int dirtree_print(const char *dirpath, DirtreeConfig *config) {
+    return dirtree_print_to_file(stdout, dirpath, config);
+}
+
+// Walk a tree, handing each entry to visitor
+int dirtree_walk(const char *dirpath, const DirtreeConfig *config, DirtreeVisitor visitor,
+                 void *userdata) {
+    if (!has_root(dirpath, config) || !visitor) {
+        fail_call(config, DIRTREE_ERR_INVALID, EINVAL);
+        return -1;
+    }
+    return walk_tree(dirpath, config, NULL, visitor, userdata, NULL, NULL);
+}
+
+// One directory on an iterator's stack
+typedef struct {
+    DirFrame frame;
+    int next;                    // Index of the next entry to yield
+    int link_hops;
+} IterLevel;
+
+// State of a pull-based traversal: the open directories of the current
+// branch, each with its sorted listing and a cursor into it
+struct DirtreeIter {
+    SkipMatcher skip;
+    TreeWalk walk;
+    IterLevel *levels;
+    int depth;
+    int capacity;
+};
+
+// Push a newly opened directory onto an iterator's stack. If the stack
+// can't grow the frame is closed and the traversal fails.
+static bool iter_push(DirtreeIter *iter, DirFrame *frame, int link_hops) {
+    if (iter->depth >= iter->capacity) {
+        int capacity = iter->capacity ? iter->capacity * 2 : 16;
+        IterLevel *levels = (IterLevel *)realloc(iter->levels, capacity * sizeof(IterLevel));
+        if (!levels) {
+            close_frame(&iter->walk, frame);
+            walk_out_of_memory(&iter->walk);
+            return false;
+        }
+        iter->levels = levels;
+        iter->capacity = capacity;
+    }
+    IterLevel *level = &iter->levels[iter->depth++];
+    level->frame = *frame;
+    level->next = 0;
+    level->link_hops = link_hops;
+    return true;
+}
+
+// Open a pull-based traversal of dirpath
+DirtreeIter *dirtree_iter_open(const char *dirpath, const DirtreeConfig *config) {
+    if (!has_root(dirpath, config)) {
+        fail_call(config, DIRTREE_ERR_INVALID, EINVAL);
+        return NULL;
+    }
+    
+    DirtreeIter *iter = (DirtreeIter *)calloc(1, sizeof(DirtreeIter));
+    if (!iter) {
+        fail_call(config, DIRTREE_ERR_NOMEM, ENOMEM);
+        return NULL;
+    }
+    
+    // Reset traversal counters
+    if (config->stats) {
+        memset(config->stats, 0, sizeof(*config->stats));
+    }
+    
+    // Set up the traversal state
+    bool ready = compile_skip_matcher(&iter->skip, config);
+    ready = init_tree_walk(&iter->walk, config, &iter->skip, NULL, config->stats) && ready;
+    if (config->cycle_policy == DIRTREE_CYCLES_VISITED) {
+        ready = init_visited_dirs(&iter->walk.visited, 256) && ready;
+    }
+    
+    // Convert to an absolute path
+    char *abs_dir = NULL;
+    if (!ready) {
+        walk_out_of_memory(&iter->walk);
+    } else {
+        abs_dir = resolve_root(&iter->walk, dirpath);
+    }
+    if (abs_dir) {
+        attach_baseline(&iter->walk, abs_dir);
+    }
+    
+    // An unreadable root yields an empty traversal
+    DirFrame root;
+    if (abs_dir && open_root_frame(&iter->walk, abs_dir, &root)) {
+        iter_push(iter, &root, 0);
+    }
+    free(abs_dir);
+    
+    report_error(&iter->walk);
+    if (walk_failed(&iter->walk)) {
+        dirtree_iter_close(iter);
+        return NULL;
+    }
+    return iter;
+}
+
+// Yield the next entry in the order the text rendering lists them
+bool dirtree_iter_next(DirtreeIter *iter, DirtreeEntry *entry) {
+    if (!iter || !entry) {
+        return false;
+    }
+    
+    while (iter->depth > 0 && !walk_failed(&iter->walk)) {
+        IterLevel *level = &iter->levels[iter->depth - 1];
+        DirFrame *frame = &level->frame;
+        
+        // Done with this directory: return to its parent
+        if (level->next >= frame->count) {
+            close_frame(&iter->walk, frame);
+            iter->depth--;
+            continue;
+        }
+        
+        const DirEntry *item = &frame->items[level->next++];
+        fill_entry(&iter->walk, frame, item, iter->depth, level->next == frame->count, entry);
+        
+        // Open a subdirectory now so its entries come next. The push may
+        // move the stack, but item lives in the arena and stays put.
+        int hops;
+        DirFrame child;
+        if (should_descend(iter->walk.config, item, iter->depth, level->link_hops, &hops) &&
+            open_child_frame(&iter->walk, frame, item, &child)) {
+            iter_push(iter, &child, hops);
+        }
+        return true;
+    }
+    report_error(&iter->walk);
+    return false;
+}
+
+// Finish a traversal early or after the last entry
+void dirtree_iter_close(DirtreeIter *iter) {
+    if (!iter) {
+        return;
     }
     
-    do {
-        // Skip . and ..
-        if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0) {
-            continue;
+    while (iter->depth > 0) {
+        close_frame(&iter->walk, &iter->levels[--iter->depth].frame);
+    }
+    report_error(&iter->walk);
+    release_tree_walk(&iter->walk);
+    free_visited_dirs(&iter->walk.visited);
+    free_skip_matcher(&iter->skip);
+    free(iter->levels);
+    free(iter);
+}
+
+// Current time in nanoseconds since the epoch
+static int64_t current_time_ns(void) {
+#ifdef _WIN32
+    return (int64_t)time(NULL) * 1000000000;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Describe a built snapshot in the header that precedes it
+static void fill_index_header(IndexHeader *header, const IndexBuilder *builder, uint64_t rules,
+                              int64_t scan_started) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header->version = INDEX_VERSION;
+    header->byte_order = INDEX_BYTE_ORDER;
+    header->header_size = sizeof(IndexHeader);
+    header->node_size = sizeof(IndexNode);
+    header->node_count = (uint32_t)builder->count;
+    header->rules = rules;
+    header->strings_offset = sizeof(IndexHeader) + builder->count * sizeof(IndexNode);
+    header->strings_size = builder->strings_size;
+    header->file_size = header->strings_offset + header->strings_size;
+    header->scan_started = scan_started;
+}
+
+// Write a built snapshot to path through a temporary file renamed over
+// it, so readers (and a snapshot of path mapped by this process) never see
+// a partial file
+static bool write_index_file(const IndexBuilder *builder, const char *path, uint64_t rules,
+                             int64_t scan_started, DirtreeError *error) {
+    IndexHeader header;
+    fill_index_header(&header, builder, rules, scan_started);
+    
+    // A temporary name of its own, so saves of the same snapshot running
+    // at once can't rename each other's half-written data into place
+    size_t path_len = strlen(path);
+    char *tmp_path = (char *)malloc(path_len + 8);
+    if (!tmp_path) {
+        record_error(error, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
+        return false;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".XXXXXX", 8);
+#ifdef _WIN32
+    FILE *file = _mktemp_s(tmp_path, path_len + 8) == 0 ? fopen(tmp_path, "wb") : NULL;
+    bool created = file != NULL;
+#else
+    // mkstemp() makes it private; a snapshot being replaced keeps its mode
+    int fd = mkstemp(tmp_path);
+    bool created = fd >= 0;
+    struct stat old;
+    if (created && stat(path, &old) == 0) {
+        fchmod(fd, old.st_mode & 07777);
+    }
+    FILE *file = created ? fdopen(fd, "wb") : NULL;
+    if (created && !file) {
+        int fdopen_errno = errno;
+        close(fd);
+        errno = fdopen_errno;
+    }
+#endif
+    bool ok = file != NULL &&
+              fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(builder->nodes, sizeof(IndexNode), builder->count, file) == builder->count &&
+              fwrite(builder->strings, 1, builder->strings_size, file) == builder->strings_size;
+    int saved_errno = errno;
+    if (file && fclose(file) != 0 && ok) {
+        ok = false;
+        saved_errno = errno;
+    }
+#ifdef _WIN32
+    // rename() won't replace an existing file on Windows
+    if (ok && !MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+        ok = false;
+        saved_errno = (int)GetLastError();
+    }
+#else
+    if (ok && rename(tmp_path, path) != 0) {
+        ok = false;
+        saved_errno = errno;
+    }
+#endif
+    if (!ok) {
+        record_error(error, DIRTREE_ERR_IO, saved_errno, path);
+        if (created) {
+            remove(tmp_path);
         }
-        
-        // Check skip conditions
-        bool is_directory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
-        if (is_directory && should_skip_dir(findData.cFileName, config)) {
-            continue;
+    }
+    free(tmp_path);
+    return ok;
+}
+
+// Scan a tree and save it as a snapshot
+int dirtree_index_save(const char *dirpath, const char *path, const DirtreeConfig *config) {
+    if (!has_root(dirpath, config) || !path) {
+        fail_call(config, DIRTREE_ERR_INVALID, EINVAL);
+        return -1;
+    }
+    
+    // Changes made while the scan runs may or may not be in it, so the
+    // snapshot vouches for nothing stamped after it started. A snapshot
+    // saved from another keeps that one's start.
+    int64_t scan_started = config->index ? config->index->header->scan_started : current_time_ns();
+    
+    IndexBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    bool ok = walk_tree(dirpath, config, NULL, NULL, NULL, &builder, NULL) == 0;
+    if (ok) {
+        DirtreeError error;
+        init_error(&error);
+        DirtreeError *report = config->error ? config->error : &error;
+        ok = write_index_file(&builder, path, rules_fingerprint(config), scan_started, report);
+    }
+    
+    free(builder.nodes);
+    free(builder.strings);
+    return ok ? 0 : -1;
+}
+
+// Check that a loaded snapshot is one this version can walk: header
+// fields, bounds of every name, and a tree structure in which each node's
+// subtree nests inside its parent's. Locates the nodes and names on the way.
+static bool validate_index(DirtreeIndex *index) {
+    const IndexHeader *header = index->header;
+    if (index->size < sizeof(IndexHeader) ||
+        memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+        header->version != INDEX_VERSION ||
+        header->byte_order != INDEX_BYTE_ORDER ||
+        header->header_size != sizeof(IndexHeader) ||
+        header->node_size != sizeof(IndexNode) ||
+        header->file_size != index->size ||
+        header->node_count == 0) {
+        return false;
+    }
+    
+    uint64_t nodes_end = sizeof(IndexHeader) + (uint64_t)header->node_count * sizeof(IndexNode);
+    if (nodes_end > index->size || header->strings_offset != nodes_end ||
+        header->strings_size != index->size - nodes_end || header->strings_size == 0) {
+        return false;
+    }
+    index->nodes = (const IndexNode *)((const char *)index->data + sizeof(IndexHeader));
+    index->strings = (const char *)index->data + nodes_end;
+    
+    const IndexNode *nodes = index->nodes;
+    uint64_t strings_size = header->strings_size;
+    uint32_t count = header->node_count;
+    for (uint32_t i = 0; i < count; i++) {
+        const IndexNode *node = &nodes[i];
+        if (node->name >= strings_size || node->name_len >= strings_size - node->name ||
+            index->strings[node->name + node->name_len] != '\0') {
+            return false;
         }
-        if (!is_directory && should_skip_file(findData.cFileName, config)) {
-            continue;
+        if (node->end <= i || node->end > count ||
+            (!(node->flags & INDEX_NODE_LISTED) && node->end != i + 1) ||
+            ((node->flags & INDEX_NODE_LISTED) && !(node->flags & INDEX_NODE_DIR))) {
+            return false;
         }
-        
-        // Create full path
-        char path[PATH_MAX];
-        snprintf(path, PATH_MAX, "%s\\%s", dir, findData.cFileName);
-        
-        // Resize array if necessary
-        if (count >= capacity) {
-            capacity *= 2;
-            items = (DirEntry *)realloc(items, capacity * sizeof(DirEntry));
-            if (!items) {
-                perror("Memory reallocation failed");
-                FindClose(hFind);
-                exit(EXIT_FAILURE);
+        if (i == 0) {
+            if (node->parent != 0 || node->end != count || !(node->flags & INDEX_NODE_DIR)) {
+                return false;
             }
+            continue;
         }
         
-        items[count].path = (char *)strdup(path);
-        items[count].name = (char *)strdup(findData.cFileName);
-        items[count].is_dir = is_directory;
-        if (!items[count].path || !items[count].name) {
-            perror("String duplication failed");
-            FindClose(hFind);
-            exit(EXIT_FAILURE);
+        // The parent is the closest earlier node whose subtree covers i
+        uint32_t parent = i - 1;
+        while (nodes[parent].end <= i) {
+            parent = nodes[parent].parent;
         }
-        
-        count++;
-    } while (FindNextFile(hFind, &findData));
+        if (node->parent != parent || node->end > nodes[parent].end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Map a snapshot file and check it
+DirtreeIndex *dirtree_index_load(const char *path, DirtreeError *error) {
+    DirtreeError local;
+    if (!error) {
+        error = &local;
+    }
+    init_error(error);
+    if (!path) {
+        record_error(error, DIRTREE_ERR_INVALID, EINVAL, NULL);
+        return NULL;
+    }
     
-    FindClose(hFind);
+    DirtreeIndex *index = (DirtreeIndex *)calloc(1, sizeof(DirtreeIndex));
+    if (!index) {
+        record_error(error, DIRTREE_ERR_NOMEM, ENOMEM, path);
+        return NULL;
+    }
+    
+#ifdef _WIN32
+    // No mmap(): read the whole file instead
+    FILE *file = fopen(path, "rb");
+    long size = -1;
+    if (file && fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+    }
+    if (size >= (long)sizeof(IndexHeader) && fseek(file, 0, SEEK_SET) == 0) {
+        index->data = malloc((size_t)size);
+        index->allocated = true;
+        if (index->data && fread(index->data, 1, (size_t)size, file) == (size_t)size) {
+            index->size = (size_t)size;
+        }
+    }
+    int saved_errno = errno;
+    if (file) {
+        fclose(file);
+    }
+    if (!index->size) {
+        record_error(error, file && size >= 0 && size < (long)sizeof(IndexHeader) ?
+                     DIRTREE_ERR_FORMAT : DIRTREE_ERR_IO, saved_errno, path);
+        free(index->data);
+        free(index);
+        return NULL;
+    }
 #else
-    DIR *d = opendir(dir);
-    if (!d) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        record_error(error, DIRTREE_ERR_IO, errno, path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(index);
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof(IndexHeader) || (uint64_t)st.st_size > SIZE_MAX) {
+        record_error(error, DIRTREE_ERR_FORMAT, 0, path);
+        close(fd);
+        free(index);
+        return NULL;
+    }
+    
+    index->size = (size_t)st.st_size;
+    index->data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (index->data == MAP_FAILED) {
+        record_error(error, DIRTREE_ERR_IO, saved_errno, path);
+        free(index);
+        return NULL;
+    }
+#endif
+    
+    index->header = (const IndexHeader *)index->data;
+    if (!validate_index(index)) {
+        record_error(error, DIRTREE_ERR_FORMAT, 0, path);
+        dirtree_index_close(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Release a snapshot
+void dirtree_index_close(DirtreeIndex *index) {
+    if (!index) {
         return;
     }
+#ifndef _WIN32
+    if (!index->allocated) {
+        munmap(index->data, index->size);
+        free(index);
+        return;
+    }
+#endif
+    free(index->data);
+    free(index);
+}
+
+// Marks of entries in a difference listing
+static const TreePiece diff_marks[3] = {
+    TREE_PIECE("+ "), TREE_PIECE("- "), TREE_PIECE("~ ")
+};
+
+#define DIFF_ADDED (&diff_marks[0])
+#define DIFF_REMOVED (&diff_marks[1])
+#define DIFF_CHANGED (&diff_marks[2])
+
+// Two snapshots compared side by side
+typedef struct {
+    const DirtreeIndex *from;
+    const DirtreeIndex *to;
+    unsigned char *differs;      // Bit per node of to: a directory in both whose subtree differs
+} TreeDiff;
+
+// One line of a directory's difference listing
+typedef struct {
+    uint32_t from;               // Node in the old snapshot, INDEX_NONE if added
+    uint32_t to;                 // Node in the new snapshot, INDEX_NONE if removed
+    const TreePiece *mark;       // NULL for a directory shown for what changed below it
+} DiffLine;
+
+// How two namesakes compare by themselves, apart from their subtrees
+typedef enum {
+    DIFF_SAME,
+    DIFF_MODIFIED,               // Size, mtime or symlink status changed
+    DIFF_REPLACED                // A file became a directory or the other way around
+} DiffKind;
+
+static DiffKind compare_namesakes(const TreeDiff *diff, uint32_t from, uint32_t to) {
+    const IndexNode *a = &diff->from->nodes[from];
+    const IndexNode *b = &diff->to->nodes[to];
+    if ((a->flags ^ b->flags) & INDEX_NODE_DIR) {
+        return DIFF_REPLACED;
+    }
+    if ((a->flags ^ b->flags) & INDEX_NODE_LINK) {
+        return DIFF_MODIFIED;
+    }
     
-    // Count and collect entries
-    struct dirent *entry;
-    int count = 0;
-    int capacity = 10;
-    DirEntry *items = (DirEntry *)malloc(capacity * sizeof(DirEntry));
-    if (!items) {
-        perror("Memory allocation failed");
-        closedir(d);
-        exit(EXIT_FAILURE);
+    // Sizes and times only mean something when both sides recorded them; a
+    // directory's own times change with its entries, shown below it
+    uint32_t both = a->flags & b->flags;
+    if ((both & INDEX_NODE_METADATA) && !(both & INDEX_NODE_DIR) &&
+        (a->size != b->size || a->mtime != b->mtime)) {
+        return DIFF_MODIFIED;
     }
+    return DIFF_SAME;
+}
+
+// Order of two children by name, the order their listings are sorted in
+static int compare_children(const TreeDiff *diff, uint32_t from, uint32_t to) {
+    return strcmp(diff->from->strings + diff->from->nodes[from].name,
+                  diff->to->strings + diff->to->nodes[to].name);
+}
+
+// Check the mark find_differences left on a directory of the new snapshot
+static bool subtree_differs(const TreeDiff *diff, uint32_t to) {
+    return (diff->differs[to / 8] >> (to % 8)) & 1;
+}
+
+// Merge the listings of a directory present in both snapshots, marking
+// in diff->differs each directory below it whose subtree differs.
+// Returns whether anything differs below it.
+static bool find_differences(TreeDiff *diff, uint32_t from_dir, uint32_t to_dir) {
+    const IndexNode *from_nodes = diff->from->nodes;
+    const IndexNode *to_nodes = diff->to->nodes;
+    uint32_t from_end = from_nodes[from_dir].end;
+    uint32_t to_end = to_nodes[to_dir].end;
+    uint32_t i = from_dir + 1;
+    uint32_t j = to_dir + 1;
+    bool found = false;
     
-    while ((entry = readdir(d)) != NULL) {
-        // Skip . and ..
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    while (i < from_end || j < to_end) {
+        int order = i >= from_end ? 1 : j >= to_end ? -1 : compare_children(diff, i, j);
+        if (order != 0) {
+            found = true;
+        } else {
+            DiffKind kind = compare_namesakes(diff, i, j);
+            if (kind != DIFF_SAME) {
+                found = true;
+            }
+            if (kind != DIFF_REPLACED && (to_nodes[j].flags & INDEX_NODE_DIR) &&
+                find_differences(diff, i, j)) {
+                diff->differs[j / 8] |= (unsigned char)(1u << (j % 8));
+                found = true;
+            }
         }
-        
-        // Create full path
-        char path[PATH_MAX];
-        snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
-        
-        // Check file type
-        struct stat st;
-        if (stat(path, &st) != 0) {
-            continue;  // Skip if we can't stat the file
+        if (order <= 0) {
+            i = from_nodes[i].end;
         }
-        
-        bool is_directory = S_ISDIR(st.st_mode);
-        
-        // Check skip conditions
-        if (is_directory && should_skip_dir(entry->d_name, config)) {
+        if (order >= 0) {
+            j = to_nodes[j].end;
+        }
+    }
+    return found;
+}
+
+// Write every entry below node of index, all with the same mark
+static void write_marked_subtree(TreeWalk *walk, const DirtreeIndex *index, uint32_t node,
+                                 const TreePiece *mark) {
+    uint32_t end = index->nodes[node].end;
+    for (uint32_t i = node + 1; i < end && !walk_failed(walk); i = index->nodes[i].end) {
+        const IndexNode *child = &index->nodes[i];
+        bool is_last = child->end == end;
+        append_tree_line(walk, mark, index->strings + child->name, child->name_len, is_last);
+        if (child->end > i + 1) {
+            size_t saved = push_prefix(walk, is_last);
+            write_marked_subtree(walk, index, i, mark);
+            walk->prefix_len = saved;
+        }
+    }
+}
+
+// Count the entries directly below a directory node
+static size_t count_child_nodes(const IndexNode *nodes, uint32_t dir) {
+    size_t count = 0;
+    for (uint32_t i = dir + 1; i < nodes[dir].end; i = nodes[i].end) {
+        count++;
+    }
+    return count;
+}
+
+// Write the differences below a directory present in both snapshots
+static void write_differences(TreeWalk *walk, const TreeDiff *diff, uint32_t from_dir,
+                              uint32_t to_dir) {
+    const IndexNode *from_nodes = diff->from->nodes;
+    const IndexNode *to_nodes = diff->to->nodes;
+    uint32_t from_end = from_nodes[from_dir].end;
+    uint32_t to_end = to_nodes[to_dir].end;
+    
+    // Collect this directory's lines first: connectors depend on which is
+    // last. Each child yields at most one line per side.
+    ArenaMark mark = arena_mark(&walk->arena);
+    size_t capacity = count_child_nodes(from_nodes, from_dir) + count_child_nodes(to_nodes, to_dir);
+    DiffLine *lines = (DiffLine *)arena_alloc(&walk->arena, capacity * sizeof(DiffLine));
+    if (!lines) {
+        walk_out_of_memory(walk);
+        return;
+    }
+    size_t count = 0;
+    uint32_t i = from_dir + 1;
+    uint32_t j = to_dir + 1;
+    while (i < from_end || j < to_end) {
+        int order = i >= from_end ? 1 : j >= to_end ? -1 : compare_children(diff, i, j);
+        if (order < 0) {
+            lines[count++] = (DiffLine){ i, INDEX_NONE, DIFF_REMOVED };
+            i = from_nodes[i].end;
             continue;
         }
-        if (!is_directory && should_skip_file(entry->d_name, config)) {
+        if (order > 0) {
+            lines[count++] = (DiffLine){ INDEX_NONE, j, DIFF_ADDED };
+            j = to_nodes[j].end;
             continue;
         }
         
-        // Resize array if necessary
-        if (count >= capacity) {
-            capacity *= 2;
-            items = (DirEntry *)realloc(items, capacity * sizeof(DirEntry));
-            if (!items) {
-                perror("Memory reallocation failed");
-                closedir(d);
-                exit(EXIT_FAILURE);
-            }
+        DiffKind kind = compare_namesakes(diff, i, j);
+        if (kind == DIFF_REPLACED) {
+            lines[count++] = (DiffLine){ i, INDEX_NONE, DIFF_REMOVED };
+            lines[count++] = (DiffLine){ INDEX_NONE, j, DIFF_ADDED };
+        } else if (kind == DIFF_MODIFIED || subtree_differs(diff, j)) {
+            lines[count++] = (DiffLine){ i, j, kind == DIFF_MODIFIED ? DIFF_CHANGED : NULL };
         }
+        i = from_nodes[i].end;
+        j = to_nodes[j].end;
+    }
+    
+    for (size_t k = 0; k < count && !walk_failed(walk); k++) {
+        const DiffLine *line = &lines[k];
+        bool is_last = k + 1 == count;
+        const DirtreeIndex *index = line->to != INDEX_NONE ? diff->to : diff->from;
+        const IndexNode *node = &index->nodes[line->to != INDEX_NONE ? line->to : line->from];
+        append_tree_line(walk, line->mark, index->strings + node->name, node->name_len, is_last);
         
-        items[count].path = (char *)strdup(path);
-        items[count].name = (char *)strdup(entry->d_name);
-        items[count].is_dir = is_directory;
-        if (!items[count].path || !items[count].name) {
-            perror("String duplication failed");
-            closedir(d);
-            exit(EXIT_FAILURE);
+        size_t saved = push_prefix(walk, is_last);
+        if (line->from == INDEX_NONE) {
+            write_marked_subtree(walk, diff->to, line->to, DIFF_ADDED);
+        } else if (line->to == INDEX_NONE) {
+            write_marked_subtree(walk, diff->from, line->from, DIFF_REMOVED);
+        } else if (subtree_differs(diff, line->to)) {
+            write_differences(walk, diff, line->from, line->to);
         }
-        
-        count++;
+        walk->prefix_len = saved;
+    }
+    arena_release(&walk->arena, mark);
+}
+
+// Compare an earlier snapshot with config->index, or with dirpath scanned now
+int dirtree_diff_to_file(FILE *output, const DirtreeIndex *old_index, const char *dirpath,
+                         DirtreeConfig *config) {
+    if (!output || !old_index || !has_root(dirpath, config)) {
+        fail_call(config, DIRTREE_ERR_INVALID, EINVAL);
+        return -1;
     }
     
-    closedir(d);
-#endif
+    // Scan the live tree into memory, with the old snapshot vouching for
+    // directories that haven't changed since
+    IndexBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    IndexHeader header;
+    DirtreeIndex scanned;
+    const DirtreeIndex *new_index = config->index;
+    if (!new_index) {
+        DirtreeConfig scan = *config;
+        scan.baseline = old_index;
+        if (walk_tree(dirpath, &scan, NULL, NULL, NULL, &builder, NULL) != 0) {
+            free(builder.nodes);
+            free(builder.strings);
+            return -1;
+        }
+        fill_index_header(&header, &builder, rules_fingerprint(config), 0);
+        memset(&scanned, 0, sizeof(scanned));
+        scanned.header = &header;
+        scanned.nodes = builder.nodes;
+        scanned.strings = builder.strings;
+        new_index = &scanned;
+    }
     
-    // Sort entries alphabetically
-    qsort(items, count, sizeof(DirEntry), compare_entries);
+    DirtreeConfig out_config = *config;
+    out_config.dirent_buffer_size = 0;
+    out_config.use_io_uring = false;
+    out_config.index = NULL;
+    StringBuffer sb;
+    TreeWalk walk;
+    TreeDiff diff = { old_index, new_index, NULL };
+    bool ready = init_stream_buffer(&sb, output, STREAM_BUFFER_SIZE);
+    ready = init_tree_walk(&walk, &out_config, NULL, ready ? &sb : NULL, NULL) && ready;
+    if (ready) {
+        diff.differs = (unsigned char *)calloc(new_index->header->node_count / 8 + 1, 1);
+    }
     
-    // Process each item
-    for (int i = 0; i < count; i++) {
-        bool is_last = (i == count - 1);
-        char current_prefix[PATH_MAX];
-        char next_prefix[PATH_MAX];
-        
-        if (is_last) {
-            snprintf(current_prefix, PATH_MAX, "%s%s", prefix, TREE_CORNER(config->format));
-            snprintf(next_prefix, PATH_MAX, "%s%s", prefix, TREE_SPACE(config->format));
-        } else {
-            snprintf(current_prefix, PATH_MAX, "%s%s", prefix, TREE_BRANCH(config->format));
-            snprintf(next_prefix, PATH_MAX, "%s%s", prefix, TREE_VERTICAL(config->format));
+    bool differs = false;
+    if (!diff.differs) {
+        walk_out_of_memory(&walk);
+    } else {
+        differs = find_differences(&diff, 0, 0);
+        write_root_line(&walk, new_index->strings + new_index->nodes[0].name);
+        if (differs) {
+            write_differences(&walk, &diff, 0, 0);
         }
-        
-        // Print the current item
-        char line[PATH_MAX + 100];
-        snprintf(line, sizeof(line), "%s%s\n", current_prefix, items[i].name);
-        string_buffer_append(sb, line);
-        
-        // Recursively process directories
-        if (items[i].is_dir) {
-            print_tree_to_buffer(sb, items[i].path, next_prefix, config, current_depth + 1, visited);
+        string_buffer_flush(&sb);
+        if (sb.error != DIRTREE_OK) {
+            record_error(&walk.error, sb.error, sb.sys_errno, NULL);
         }
-        
-        free(items[i].path);
-        free(items[i].name);
     }
     
-    free(items);
+    int result = walk_failed(&walk) ? -1 : differs ? 1 : 0;
+    report_error(&walk);
+    release_tree_walk(&walk);
+    if (ready) {
+        free(string_buffer_release(&sb));
+    }
+    free(diff.differs);
+    free(builder.nodes);
+    free(builder.strings);
+    return result;
 }
 
-// Initialize the default configuration
-void dirtree_init_config(DirtreeConfig *config) {
-    if (!config) return;
-    
-    config->max_depth = -1;  // No limit by default
-    config->skip_hidden = true;
-    config->skip_common = true;
-    
-    // Use Unicode by default, fallback to ASCII on Windows
-#ifdef _WIN32
-    config->format = DIRTREE_FORMAT_ASCII;
-#else
-    config->format = DIRTREE_FORMAT_UNICODE;
+#ifdef DIRTREE_HAVE_INOTIFY
+// The directory behind one inotify watch descriptor
+typedef struct {
+    DirId id;                    // Zero once the watch is gone
+    bool changed;                // Named by an event since the last scan, or watched after it
+} WatchedDir;
+#endif
+
+// A tree kept in memory and rescanned when inotify reports changes. A
+// rescan only reads the directories events named; the others are listed
+// from the previous tree, unless the event queue overflowed.
+struct DirtreeWatch {
+    const DirtreeConfig *config;
+    DirtreeIndex *index;         // The tree as of the last scan
+#ifdef DIRTREE_HAVE_INOTIFY
+    int fd;                      // inotify instance
+    VisitedDirs watched;         // Directories holding a watch
+    WatchedDir *watches;         // By watch descriptor
+    int watch_capacity;
+    bool watch_lost;             // A watch went away; watched must be rebuilt from watches
+    bool overflowed;             // Events were dropped: the next scan checks every directory
+    bool pending;                // Changes arrived since the last scan
+    int64_t first_change;        // Monotonic nanoseconds of the first and latest pending change
+    int64_t last_change;
 #endif
+};
+
+#ifdef DIRTREE_HAVE_INOTIFY
+// Pack a built snapshot into one allocation, as if it had been loaded
+static DirtreeIndex *index_from_builder(const IndexBuilder *builder, uint64_t rules,
+                                        int64_t scan_started) {
+    DirtreeIndex *index = (DirtreeIndex *)calloc(1, sizeof(DirtreeIndex));
+    IndexHeader header;
+    fill_index_header(&header, builder, rules, scan_started);
+    char *data = index ? (char *)malloc((size_t)header.file_size) : NULL;
+    if (!data) {
+        free(index);
+        return NULL;
+    }
     
-    config->custom_skip_dirs = NULL;
-    config->custom_skip_files = NULL;
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), builder->nodes, builder->count * sizeof(IndexNode));
+    memcpy(data + header.strings_offset, builder->strings, builder->strings_size);
+    index->data = data;
+    index->size = (size_t)header.file_size;
+    index->allocated = true;
+    index->header = (const IndexHeader *)data;
+    index->nodes = (const IndexNode *)(data + sizeof(header));
+    index->strings = data + header.strings_offset;
+    return index;
 }
 
-// Free resources allocated for the configuration
-void dirtree_free_config(DirtreeConfig *config) {
-    if (!config) return;
-    
-    if (config->custom_skip_dirs) {
-        for (int i = 0; config->custom_skip_dirs[i] != NULL; i++) {
-            free(config->custom_skip_dirs[i]);
+// Check whether two snapshots hold the same tree as it is walked: names,
+// kinds, nesting and recorded metadata, but not the stamps directories
+// carry for rescans
+static bool same_tree(const DirtreeIndex *a, const DirtreeIndex *b) {
+    if (a->header->node_count != b->header->node_count) {
+        return false;
+    }
+    for (uint32_t i = 0; i < a->header->node_count; i++) {
+        const IndexNode *x = &a->nodes[i];
+        const IndexNode *y = &b->nodes[i];
+        if (x->end != y->end || x->name_len != y->name_len ||
+            (x->flags & ~INDEX_NODE_STAMPED) != (y->flags & ~INDEX_NODE_STAMPED) ||
+            memcmp(a->strings + x->name, b->strings + y->name, x->name_len) != 0) {
+            return false;
+        }
+        if ((x->flags & INDEX_NODE_METADATA) && (x->size != y->size || x->mtime != y->mtime)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Record a failure of a watch in the caller's report
+static void watch_fail(const DirtreeWatch *watch, DirtreeErrorCode code, int sys_errno,
+                       const char *path) {
+    if (watch->config->error) {
+        record_error(watch->config->error, code, sys_errno, path);
+    }
+}
+
+// Build the path of a snapshot node into *buf from the root's absolute
+// path and the names below it. Returns false if out of memory.
+static bool index_node_path(const DirtreeIndex *index, uint32_t node, char **buf, size_t *capacity) {
+    size_t len = 0;
+    for (uint32_t i = node; ; i = index->nodes[i].parent) {
+        len += index->nodes[i].name_len + 1;
+        if (i == 0) {
+            break;
         }
-        free(config->custom_skip_dirs);
-        config->custom_skip_dirs = NULL;
+    }
+    if (len > *capacity) {
+        char *grown = (char *)realloc(*buf, len);
+        if (!grown) {
+            return false;
+        }
+        *buf = grown;
+        *capacity = len;
     }
     
-    if (config->custom_skip_files) {
-        for (int i = 0; config->custom_skip_files[i] != NULL; i++) {
-            free(config->custom_skip_files[i]);
+    // Fill from the end: each name, preceded by a separator below the root
+    size_t end = len - 1;
+    (*buf)[end] = '\0';
+    for (uint32_t i = node; ; i = index->nodes[i].parent) {
+        const IndexNode *n = &index->nodes[i];
+        end -= n->name_len;
+        memcpy(*buf + end, index->strings + n->name, n->name_len);
+        if (i == 0) {
+            break;
         }
-        free(config->custom_skip_files);
-        config->custom_skip_files = NULL;
+        (*buf)[--end] = '/';
     }
+    return true;
 }
 
-// Add custom directory to skip
-void dirtree_add_skip_dir(DirtreeConfig *config, const char *dirname) {
-    if (!config || !dirname) return;
-    
-    int count = 0;
-    if (config->custom_skip_dirs) {
-        // Count existing entries
-        while (config->custom_skip_dirs[count] != NULL) {
-            count++;
+// Forget watches that went away, so their directories (or new ones that
+// reuse the inode) get a watch again. Returns false if out of memory.
+static bool rebuild_watched(DirtreeWatch *watch) {
+    VisitedDirs watched;
+    if (!init_visited_dirs(&watched, watch->watched.capacity)) {
+        return false;
+    }
+    for (int wd = 0; wd < watch->watch_capacity; wd++) {
+        DirId id = watch->watches[wd].id;
+        if ((id.dev != 0 || id.ino != 0) && mark_visited(&watched, id) < 0) {
+            free_visited_dirs(&watched);
+            return false;
         }
     }
+    free_visited_dirs(&watch->watched);
+    watch->watched = watched;
+    watch->watch_lost = false;
+    return true;
+}
+
+// Add a watch to every listed directory of the current tree that has
+// none yet. Returns the number added, or -1 on failure.
+static int watch_new_directories(DirtreeWatch *watch) {
+    if (watch->watch_lost && !rebuild_watched(watch)) {
+        watch_fail(watch, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
+        return -1;
+    }
     
-    // Allocate or reallocate the array
-    config->custom_skip_dirs = (char **)realloc(
-        config->custom_skip_dirs, (count + 2) * sizeof(char *)
-    );
-    
-    if (!config->custom_skip_dirs) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+    // Entries and their metadata change the tree; content changes alone don't
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                    IN_MOVE_SELF | IN_ONLYDIR;
+    if (watch->config->collect_metadata) {
+        mask |= IN_MODIFY | IN_ATTRIB;
+    }
+    if (watch->config->use_ignore_files) {
+        mask |= IN_CLOSE_WRITE;
     }
     
-    // Add the new entry and NULL terminator
-    config->custom_skip_dirs[count] = (char *)strdup(dirname);
-    config->custom_skip_dirs[count + 1] = NULL;
+    const DirtreeIndex *index = watch->index;
+    uint32_t needed = INDEX_NODE_LISTED | INDEX_NODE_STAMPED;
+    char *path = NULL;
+    size_t path_capacity = 0;
+    int added = 0;
+    for (uint32_t i = 0; i < index->header->node_count; i++) {
+        const IndexNode *node = &index->nodes[i];
+        DirId id = { node->dev, node->ino };
+        if ((node->flags & needed) != needed ||
+            is_visited(&watch->watched, id)) {
+            continue;
+        }
+        if (!index_node_path(index, i, &path, &path_capacity)) {
+            watch_fail(watch, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
+            added = -1;
+            break;
+        }
+        
+        // A directory gone since the scan is picked up by its parent's event
+        int wd = inotify_add_watch(watch->fd, path, mask);
+        if (wd < 0) {
+            if (errno == ENOENT || errno == ENOTDIR || errno == EACCES) {
+                continue;
+            }
+            watch_fail(watch, DIRTREE_ERR_IO, errno, path);
+            added = -1;
+            break;
+        }
+        if (wd >= watch->watch_capacity) {
+            int capacity = watch->watch_capacity ? watch->watch_capacity : 256;
+            while (capacity <= wd) {
+                capacity *= 2;
+            }
+            WatchedDir *watches = (WatchedDir *)realloc(watch->watches, capacity * sizeof(WatchedDir));
+            if (!watches) {
+                watch_fail(watch, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
+                added = -1;
+                break;
+            }
+            memset(watches + watch->watch_capacity, 0,
+                   (capacity - watch->watch_capacity) * sizeof(WatchedDir));
+            watch->watches = watches;
+            watch->watch_capacity = capacity;
+        }
+        
+        // Changes made before the watch existed are only caught by reading
+        // the directory once more
+        watch->watches[wd].id = id;
+        watch->watches[wd].changed = true;
+        if (mark_visited(&watch->watched, id) < 0) {
+            watch_fail(watch, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
+            added = -1;
+            break;
+        }
+        added++;
+    }
+    free(path);
+    return added;
 }
 
-// Add custom file to skip
-void dirtree_add_skip_file(DirtreeConfig *config, const char *filename) {
-    if (!config || !filename) return;
+// Read the queued events without blocking. Any of them makes a rescan
+// pending and marks the directory it names as changed; after an
+// overflowed queue every directory is checked.
+static void drain_watch_events(DirtreeWatch *watch) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(watch->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            bool known = event->wd >= 0 && event->wd < watch->watch_capacity;
+            if (event->mask & IN_IGNORED) {
+                if (known) {
+                    memset(&watch->watches[event->wd], 0, sizeof(WatchedDir));
+                    watch->watch_lost = true;
+                }
+                continue;
+            }
+            // Files written in place only matter when they are ignore files
+            if (event->mask == IN_CLOSE_WRITE && (event->len == 0 || !ignore_file_kind(event->name))) {
+                continue;
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                watch->overflowed = true;
+            } else if (known) {
+                watch->watches[event->wd].changed = true;
+            }
+            int64_t now = monotonic_ns();
+            if (!watch->pending) {
+                watch->pending = true;
+                watch->first_change = now;
+            }
+            watch->last_change = now;
+        }
+    }
+}
+
+// Gather the watched directories no event has named since the last scan,
+// which the next one can list from the previous tree. Returns false if out
+// of memory.
+static bool collect_settled_dirs(const DirtreeWatch *watch, VisitedDirs *settled) {
+    if (!init_visited_dirs(settled, watch->watched.capacity)) {
+        return false;
+    }
+    for (int wd = 0; wd < watch->watch_capacity; wd++) {
+        const WatchedDir *dir = &watch->watches[wd];
+        if ((dir->id.dev != 0 || dir->id.ino != 0) && !dir->changed &&
+            mark_visited(settled, dir->id) < 0) {
+            free_visited_dirs(settled);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Scan the tree again, with baseline vouching for unchanged directories,
+// and watch any new ones. When baseline is the previous tree, only the
+// directories events named are read, unless events were dropped. Sets
+// *changed if the tree differs from the previous one. Returns false on
+// failure, keeping the previous tree.
+static bool watch_scan(DirtreeWatch *watch, const char *dirpath, const DirtreeIndex *baseline,
+                       bool *changed) {
+    DirtreeConfig scan = *watch->config;
+    scan.index = NULL;
+    scan.baseline = baseline;
     
-    int count = 0;
-    if (config->custom_skip_files) {
-        // Count existing entries
-        while (config->custom_skip_files[count] != NULL) {
-            count++;
+    VisitedDirs settled = { NULL, 0, 0 };
+    bool incremental = baseline && baseline == watch->index && !watch->overflowed;
+    if (incremental && !collect_settled_dirs(watch, &settled)) {
+        watch_fail(watch, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
+        return false;
+    }
+    
+    int64_t scan_started = current_time_ns();
+    IndexBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    DirtreeIndex *index = NULL;
+    if (walk_tree(dirpath, &scan, NULL, NULL, NULL, &builder, incremental ? &settled : NULL) == 0) {
+        index = index_from_builder(&builder, rules_fingerprint(&scan), scan_started);
+        if (!index) {
+            watch_fail(watch, DIRTREE_ERR_NOMEM, ENOMEM, NULL);
         }
     }
+    free(builder.nodes);
+    free(builder.strings);
+    free_visited_dirs(&settled);
+    if (!index) {
+        return false;
+    }
     
-    // Allocate or reallocate the array
-    config->custom_skip_files = (char **)realloc(
-        config->custom_skip_files, (count + 2) * sizeof(char *)
-    );
-    
-    if (!config->custom_skip_files) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+    // Every change seen so far is in the new tree
+    for (int wd = 0; wd < watch->watch_capacity; wd++) {
+        watch->watches[wd].changed = false;
     }
+    watch->overflowed = false;
     
-    // Add the new entry and NULL terminator
-    config->custom_skip_files[count] = (char *)strdup(filename);
-    config->custom_skip_files[count + 1] = NULL;
+    *changed = !watch->index || !same_tree(watch->index, index);
+    dirtree_index_close(watch->index);
+    watch->index = index;
+    
+    // Changes made in a new directory before its watch existed are only
+    // caught by scanning once more
+    int added = watch_new_directories(watch);
+    if (added > 0) {
+        watch->pending = true;
+        watch->first_change = watch->last_change = monotonic_ns();
+    }
+    return added >= 0;
 }
+#endif
 
-// Generate directory tree as string
-char *dirtree_generate_string(const char *dirpath, DirtreeConfig *config) {
+// Scan a tree into memory and start watching it
+DirtreeWatch *dirtree_watch_open(const char *dirpath, const DirtreeConfig *config) {
     if (!dirpath || !config) {
+        fail_call(config, DIRTREE_ERR_INVALID, EINVAL);
         return NULL;
     }
-    
-    // Convert to an absolute path
-    char *abs_dir = get_absolute_path(dirpath);
-    if (!abs_dir) {
+#ifdef DIRTREE_HAVE_INOTIFY
+    DirtreeWatch *watch = (DirtreeWatch *)calloc(1, sizeof(DirtreeWatch));
+    if (!watch || !init_visited_dirs(&watch->watched, 256)) {
+        free(watch);
+        fail_call(config, DIRTREE_ERR_NOMEM, ENOMEM);
+        return NULL;
+    }
+    watch->config = config;
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) {
+        fail_call(config, DIRTREE_ERR_IO, errno);
+        dirtree_watch_close(watch);
         return NULL;
     }
     
-    // Initialize string buffer
-    StringBuffer sb;
-    init_string_buffer(&sb, 4096);  // Start with 4KB buffer
-    
-    // Extract and print the root directory name
-    char *base_name;
-    
-#ifdef _WIN32
-    base_name = strrchr(abs_dir, '\\');
+    bool changed;
+    if (!watch_scan(watch, dirpath, config->baseline, &changed)) {
+        dirtree_watch_close(watch);
+        return NULL;
+    }
+    return watch;
 #else
-    base_name = strrchr(abs_dir, '/');
+    fail_call(config, DIRTREE_ERR_INVALID, ENOSYS);
+    return NULL;
 #endif
-    
-    if (base_name == NULL) {
-        base_name = abs_dir;
-    } else {
-        base_name++;  // Skip the separator
-    }
-    
-    string_buffer_append(&sb, base_name);
-    string_buffer_append(&sb, "\n");
-    
-    // Initialize visited directories
-    VisitedDirs visited;
-    init_visited_dirs(&visited, 100);
-    
-    // Generate the tree
-    print_tree_to_buffer(&sb, abs_dir, "", config, 1, &visited);
-    
-    // Clean up
-    free_visited_dirs(&visited);
-    free(abs_dir);
-    
-    // Return the generated string
-    return string_buffer_release(&sb);
 }
 
-// Print directory tree to specified file
-int dirtree_print_to_file(FILE *output, const char *dirpath, DirtreeConfig *config) {
-    if (!output || !dirpath || !config) {
+// Wait for changes and rescan once they settle
+int dirtree_watch_update(DirtreeWatch *watch, int timeout_ms) {
+    if (!watch) {
         return -1;
     }
+#ifdef DIRTREE_HAVE_INOTIFY
+    const int64_t ms = 1000000;
+    int64_t debounce = (int64_t)(watch->config->watch_debounce_ms > 0 ?
+                                 watch->config->watch_debounce_ms : 0) * ms;
+    int64_t deadline = timeout_ms >= 0 ? monotonic_ns() + (int64_t)timeout_ms * ms : -1;
     
-    char *tree_string = dirtree_generate_string(dirpath, config);
-    if (!tree_string) {
-        return -1;
+    // Events are read at least once, even with a zero timeout
+    for (bool polled = false; ; polled = true) {
+        // Rescan once changes have been quiet for the debounce time, or
+        // have kept coming for ten times that
+        int64_t now = monotonic_ns();
+        int64_t wait = -1;
+        if (watch->pending) {
+            int64_t due = watch->last_change + debounce;
+            if (due > watch->first_change + 10 * debounce) {
+                due = watch->first_change + 10 * debounce;
+            }
+            if (due <= now) {
+                watch->pending = false;
+                bool changed = false;
+                const char *root = watch->index->strings + watch->index->nodes[0].name;
+                if (!watch_scan(watch, root, watch->index, &changed)) {
+                    return -1;
+                }
+                if (changed) {
+                    return 1;
+                }
+                continue;
+            }
+            wait = due - now;
+        }
+        if (deadline >= 0) {
+            if (deadline <= now && polled) {
+                return 0;
+            }
+            int64_t left = deadline > now ? deadline - now : 0;
+            if (wait < 0 || left < wait) {
+                wait = left;
+            }
+        }
+        
+        struct pollfd pfd = { watch->fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, wait < 0 ? -1 : (int)((wait + ms - 1) / ms));
+        if (ready < 0 && errno != EINTR) {
+            watch_fail(watch, DIRTREE_ERR_IO, errno, NULL);
+            return -1;
+        }
+        if (ready > 0) {
+            drain_watch_events(watch);
+        }
     }
-    
-    int result = fputs(tree_string, output);
-    free(tree_string);
-    
-    return (result >= 0) ? 0 : -1;
+#else
+    (void)timeout_ms;
+    return -1;
+#endif
 }
 
-// Print directory tree to stdout
-int dirtree_print(const char *dirpath, DirtreeConfig *config) {
-    return dirtree_print_to_file(stdout, dirpath, config);
+// Descriptor to poll for changes
+int dirtree_watch_fd(const DirtreeWatch *watch) {
+#ifdef DIRTREE_HAVE_INOTIFY
+    return watch ? watch->fd : -1;
+#else
+    (void)watch;
+    return -1;
+#endif
+}
+
+// The tree as of the last scan
+const DirtreeIndex *dirtree_watch_index(const DirtreeWatch *watch) {
+    return watch ? watch->index : NULL;
+}
+
+// Stop watching
+void dirtree_watch_close(DirtreeWatch *watch) {
+    if (!watch) {
+        return;
+    }
+#ifdef DIRTREE_HAVE_INOTIFY
+    if (watch->fd >= 0) {
+        close(watch->fd);
+    }
+    free_visited_dirs(&watch->watched);
+    free(watch->watches);
+#endif
+    dirtree_index_close(watch->index);
+    free(watch);
 }
 
 // Version information
@@ -648,6 +5973,12 @@ const char *dirtree_version(void) {
 // Main function (only used for standalone binary, not when used as a library)
 #ifndef DIRTREE_LIBRARY_ONLY
 #include <getopt.h>
+#ifndef _WIN32
+    #include <signal.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+#endif
 
 // Print help message
 static void print_help(const char *program_name) {
@@ -661,6 +5992,29 @@ static void print_help(const char *program_name) {
     printf("  -a, --all                Disable skipping of common directories/files\n");
     printf("  -u, --unicode            Use Unicode characters for tree (default on Unix)\n");
     printf("  -A, --ascii              Use ASCII characters for tree (default on Windows)\n");
+    printf("  -S, --stat               Always stat entries instead of trusting d_type\n");
+    printf("  -s, --stats              Print traversal counters to stderr\n");
+    printf("  -b, --dirent-buffer=KB   Read directories with getdents64 into a KB-sized buffer (Linux)\n");
+    printf("  -i, --io-uring           Batch stat calls per directory through io_uring (Linux)\n");
+    printf("  -j, --threads=N          Scan directories on N threads (output is unchanged)\n");
+    printf("  -C, --cycles=POLICY      Cycle detection: visited (default) or ancestors\n");
+    printf("  -m, --metadata           Record file sizes and times in snapshots, so --diff sees changes\n");
+    printf("  -g, --gitignore          Leave out what .gitignore and .ignore files in the tree exclude\n");
+    printf("      --include=GLOB       Only show files matching GLOB (repeatable; with a '/', matches the path)\n");
+    printf("      --ext=LIST           Only show files with these comma-separated extensions\n");
+    printf("      --exclude=GLOB       Leave out files and directories matching GLOB (repeatable)\n");
+    printf("      --prune-empty        Leave out directories with nothing shown below them\n");
+    printf("      --max-entries=N      Stop after N entries, ending with a truncation marker\n");
+    printf("      --max-bytes=N        Stop before the output grows past N bytes\n");
+    printf("      --max-time=MS        Stop reading after MS milliseconds\n");
+    printf("      --max-children=N     List N entries per directory, then a count of the others\n");
+    printf("      --save-index=FILE    Save the scanned tree as a snapshot, then print it\n");
+    printf("      --load-index=FILE    Print a saved snapshot instead of scanning (directory is ignored)\n");
+    printf("      --baseline=FILE      Reuse unchanged directories from an earlier snapshot of the directory\n");
+    printf("      --watch              Keep watching the directory and print the tree again when it changes (Linux)\n");
+    printf("      --debounce=MS        Quiet time after a change before --watch rescans (default: 200)\n");
+    printf("      --serve=SOCKET       Keep trees watched and answer requests on a Unix socket (Linux)\n");
+    printf("      --diff=FILE          Show what changed since snapshot FILE: in the directory, or in --load-index\n");
     printf("\n");
     printf("Arguments:\n");
     printf("  directory                Directory to display (default: current directory)\n");
@@ -676,11 +6030,550 @@ static void print_help(const char *program_name) {
     printf("\n");
 }
 
+// Describe a failed call on out after label
+static void print_error(FILE *out, const char *label, const DirtreeError *error) {
+    fprintf(out, "%s: %s%s%s\n", label, error->path, error->path[0] ? ": " : "",
+            error->code == DIRTREE_ERR_FORMAT ? "not a valid dirtree snapshot" :
+            strerror(error->sys_errno));
+}
+
+// Long options without a short form
+enum {
+    OPT_SAVE_INDEX = 256,
+    OPT_LOAD_INDEX,
+    OPT_BASELINE,
+    OPT_WATCH,
+    OPT_DEBOUNCE,
+    OPT_SERVE,
+    OPT_DIFF,
+    OPT_INCLUDE,
+    OPT_EXCLUDE,
+    OPT_EXT,
+    OPT_PRUNE_EMPTY,
+    OPT_MAX_ENTRIES,
+    OPT_MAX_BYTES,
+    OPT_MAX_TIME,
+    OPT_MAX_CHILDREN
+};
+
+// Print the counters of the last traversal to stderr
+static void print_stats(const DirtreeStats *stats, const DirtreeError *error) {
+    fprintf(stderr, "entries scanned: %lu\n", stats->entries_scanned);
+    fprintf(stderr, "stat calls:      %lu\n", stats->stat_calls);
+    fprintf(stderr, "stats avoided:   %lu\n", stats->stats_avoided);
+    fprintf(stderr, "stats batched:   %lu\n", stats->stats_batched);
+    fprintf(stderr, "dirs reused:     %lu\n", stats->dirs_reused);
+    fprintf(stderr, "output bytes:    %lu\n", (unsigned long)stats->output_bytes);
+    fprintf(stderr, "dirs unreadable: %lu\n", error->dirs_unreadable);
+    fprintf(stderr, "dirs skipped:    %lu\n", error->dirs_skipped);
+}
+
+// Print the tree, then print it again, after an empty line, each time it
+// changes. Only returns on failure.
+static int watch_and_print(const char *dir, DirtreeConfig *config) {
+    DirtreeWatch *watch = dirtree_watch_open(dir, config);
+    if (!watch) {
+        return -1;
+    }
+    
+    int result = 0;
+    bool first = true;
+    while (result >= 0) {
+        if (!first) {
+            printf("\n");
+        }
+        first = false;
+        config->index = dirtree_watch_index(watch);
+        result = dirtree_print(dir, config);
+        fflush(stdout);
+        if (config->stats) {
+            print_stats(config->stats, config->error);
+        }
+        
+        // Wait for the next change
+        while (result == 0 && (result = dirtree_watch_update(watch, -1)) == 0) {
+        }
+    }
+    config->index = NULL;
+    dirtree_watch_close(watch);
+    return -1;
+}
+
+#ifndef _WIN32
+// Trees kept by --serve at once; the least recently used goes first
+#define SERVE_MAX_TREES 8
+
+// Longest request --serve reads
+#define SERVE_MAX_REQUEST (64 * 1024)
+
+// Longest a scan answering a request from disk, while its tree is still
+// being loaded, may hold up the other clients
+#define SERVE_DISK_SCAN_MS 1000
+
+// A tree kept resident by --serve: a watch scanned with one set of skip
+// rules and no depth limit, so that requests differing only in depth or
+// format share it. The watch's first scan runs on a thread of its own,
+// which signals through done_fd once it is over.
+typedef struct {
+    char *root;                  // Absolute path
+    uint64_t rules;              // rules_fingerprint() of config at unlimited depth
+    DirtreeConfig config;        // Scan rules, owning their skip lists
+    DirtreeError error;
+    DirtreeWatch *watch;         // NULL while loading
+    bool loading;                // loader is still scanning
+    int loaded;                  // Set by loader once opened holds its outcome
+    pthread_t loader;
+    DirtreeWatch *opened;        // The loader's watch, NULL if it failed
+    int done_fd;                 // Written to by the loader when it is done
+    unsigned long last_used;
+} ServedTree;
+
+static volatile sig_atomic_t serve_stopped = 0;
+
+static void stop_serving(int signum) {
+    (void)signum;
+    serve_stopped = 1;
+}
+
+// Wait for the loader of a tree to finish, taking its watch
+static void finish_loading(ServedTree *tree) {
+    pthread_join(tree->loader, NULL);
+    tree->loading = false;
+    tree->watch = tree->opened;
+    tree->opened = NULL;
+}
+
+// Release a resident tree
+static void close_served_tree(ServedTree *tree) {
+    if (tree->loading) {
+        finish_loading(tree);
+    }
+    dirtree_watch_close(tree->watch);
+    dirtree_free_config(&tree->config);
+    free(tree->root);
+    memset(tree, 0, sizeof(*tree));
+}
+
+// Parse one request: "key value" lines ending with an empty line or the
+// end of the stream. Fills config (whose skip lists it owns), the root
+// and the depth to render. Returns NULL on success, else what was wrong.
+static const char *parse_request(char *request, DirtreeConfig *config, const char **root,
+                                 int *depth) {
+    char *save = NULL;
+    for (char *line = strtok_r(request, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            break;
+        }
+        char *value = strchr(line, ' ');
+        if (value) {
+            *value++ = '\0';
+        }
+        
+        if (strcmp(line, "all") == 0 && !value) {
+            config->skip_common = false;
+            config->skip_hidden = false;
+        } else if (strcmp(line, "gitignore") == 0 && !value) {
+            config->use_ignore_files = true;
+        } else if (strcmp(line, "prune-empty") == 0 && !value) {
+            config->prune_empty = true;
+        } else if (!value) {
+            return "expected 'key value'";
+        } else if (strcmp(line, "root") == 0) {
+            *root = value;
+        } else if (strcmp(line, "depth") == 0) {
+            *depth = atoi(value);
+        } else if (strcmp(line, "max-entries") == 0) {
+            config->max_entries = strtoul(value, NULL, 10);
+        } else if (strcmp(line, "max-bytes") == 0) {
+            config->max_output_bytes = (size_t)strtoull(value, NULL, 10);
+        } else if (strcmp(line, "max-time") == 0) {
+            config->max_time_ms = atoi(value);
+        } else if (strcmp(line, "max-children") == 0) {
+            config->max_children_per_dir = atoi(value);
+        } else if (strcmp(line, "format") == 0) {
+            if (strcmp(value, "ascii") == 0) {
+                config->format = DIRTREE_FORMAT_ASCII;
+            } else if (strcmp(value, "unicode") == 0) {
+                config->format = DIRTREE_FORMAT_UNICODE;
+            } else {
+                return "unknown format";
+            }
+        } else if (strcmp(line, "cycles") == 0) {
+            if (strcmp(value, "visited") == 0) {
+                config->cycle_policy = DIRTREE_CYCLES_VISITED;
+            } else if (strcmp(value, "ancestors") == 0) {
+                config->cycle_policy = DIRTREE_CYCLES_ANCESTORS;
+            } else {
+                return "unknown cycle policy";
+            }
+        } else if (strcmp(line, "skip-dir") == 0) {
+            if (dirtree_add_skip_dir(config, value) != 0) {
+                return strerror(ENOMEM);
+            }
+        } else if (strcmp(line, "skip-file") == 0) {
+            if (dirtree_add_skip_file(config, value) != 0) {
+                return strerror(ENOMEM);
+            }
+        } else if (strcmp(line, "include") == 0) {
+            if (dirtree_add_include(config, value) != 0) {
+                return strerror(ENOMEM);
+            }
+        } else if (strcmp(line, "exclude") == 0) {
+            if (dirtree_add_exclude(config, value) != 0) {
+                return strerror(ENOMEM);
+            }
+        } else if (strcmp(line, "ext") == 0) {
+            if (dirtree_add_extension(config, value) != 0) {
+                return strerror(ENOMEM);
+            }
+        } else {
+            return "unknown request field";
+        }
+    }
+    return NULL;
+}
+
+// Loader thread: scan a tree and start watching it
+static void *load_served_tree(void *arg) {
+    ServedTree *tree = (ServedTree *)arg;
+    tree->opened = dirtree_watch_open(tree->root, &tree->config);
+    __atomic_store_n(&tree->loaded, 1, __ATOMIC_RELEASE);
+    char done = 1;
+    while (write(tree->done_fd, &done, 1) < 0 && errno == EINTR) {
+    }
+    return NULL;
+}
+
+// Check whether root is the served directory or lies below it
+static bool is_served_root(const char *root, const char *served) {
+    size_t len = strlen(served);
+    return strncmp(root, served, len) == 0 &&
+           (root[len] == '\0' || root[len] == '/' || (len > 0 && served[len - 1] == '/'));
+}
+
+// Find the resident tree for root and the rules of config. If there is
+// none, start loading one on a thread in a free or least recently used
+// slot; config is then taken over (*adopted is set). Returns NULL if the
+// tree isn't loaded yet, with error left at DIRTREE_OK, or if out of
+// memory, described in error.
+static ServedTree *find_served_tree(ServedTree *trees, const char *root, DirtreeConfig *config,
+                                    bool *adopted, unsigned long now, int done_fd,
+                                    DirtreeError *error) {
+    DirtreeConfig scan = *config;
+    scan.max_depth = -1;
+    uint64_t rules = rules_fingerprint(&scan);
+    
+    ServedTree *slot = NULL;
+    for (int i = 0; i < SERVE_MAX_TREES; i++) {
+        ServedTree *tree = &trees[i];
+        if (tree->root && tree->rules == rules && strcmp(tree->root, root) == 0) {
+            tree->last_used = now;
+            return tree->watch ? tree : NULL;
+        }
+        if (!tree->loading &&
+            (!slot || !tree->root || (slot->root && tree->last_used < slot->last_used))) {
+            slot = tree;
+        }
+    }
+    
+    // Take the free slot, or the least recently used one; with every
+    // slot loading, the request is answered from disk alone
+    if (!slot) {
+        return NULL;
+    }
+    if (slot->root) {
+        close_served_tree(slot);
+    }
+    slot->root = strdup(root);
+    if (!slot->root) {
+        error->code = DIRTREE_ERR_NOMEM;
+        error->sys_errno = ENOMEM;
+        return NULL;
+    }
+    slot->rules = rules;
+    slot->config = scan;
+    slot->config.error = &slot->error;
+    slot->config.index = NULL;
+    slot->config.baseline = NULL;
+    slot->config.stats = NULL;
+    slot->done_fd = done_fd;
+    slot->last_used = now;
+    *adopted = true;
+    
+    // The loader leaves SIGINT and SIGTERM to the accept loop
+    sigset_t block;
+    sigset_t old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    slot->loading = pthread_create(&slot->loader, NULL, load_served_tree, slot) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!slot->loading) {
+        // Without a loader the request keeps its lists, to be read from disk
+        dirtree_init_config(&slot->config);
+        *adopted = false;
+        close_served_tree(slot);
+    }
+    return NULL;
+}
+
+// Take the outcome of every loader that has finished
+static void take_loaded_trees(ServedTree *trees) {
+    for (int i = 0; i < SERVE_MAX_TREES; i++) {
+        ServedTree *tree = &trees[i];
+        if (tree->loading && __atomic_load_n(&tree->loaded, __ATOMIC_ACQUIRE)) {
+            finish_loading(tree);
+            if (!tree->watch) {
+                close_served_tree(tree);
+            }
+        }
+    }
+}
+
+// Answer one client: "ok" and the rendered tree, or "error: " and why.
+// Roots must lie in served. A tree that isn't resident yet is read from
+// disk within the request's limits and SERVE_DISK_SCAN_MS.
+static void serve_client(int fd, ServedTree *trees, const char *served, const char *default_root,
+                         const DirtreeConfig *defaults, unsigned long now, int done_fd) {
+    // Don't let a stalled client hold up the others for long
+    struct timeval limit = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
+    
+    // Read up to the empty line that ends the request
+    char *request = (char *)malloc(SERVE_MAX_REQUEST + 1);
+    size_t len = 0;
+    while (request && len < SERVE_MAX_REQUEST) {
+        ssize_t n = read(fd, request + len, SERVE_MAX_REQUEST - len);
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+        request[len] = '\0';
+        if (strstr(request, "\n\n") || strstr(request, "\r\n\r\n")) {
+            break;
+        }
+    }
+    
+    DirtreeConfig config;
+    dirtree_init_config(&config);
+    config.skip_common = defaults->skip_common;
+    config.skip_hidden = defaults->skip_hidden;
+    config.format = defaults->format;
+    config.cycle_policy = defaults->cycle_policy;
+    config.use_ignore_files = defaults->use_ignore_files;
+    config.prune_empty = defaults->prune_empty;
+    config.watch_debounce_ms = defaults->watch_debounce_ms;
+    const char *root = default_root;
+    int depth = defaults->max_depth;
+    const char *problem = NULL;
+    if (!request) {
+        problem = strerror(ENOMEM);
+    } else {
+        request[len] = '\0';
+        char *end = strstr(request, "\n\n");
+        if (end) {
+            end[1] = '\0';
+        }
+        problem = parse_request(request, &config, &root, &depth);
+    }
+    
+    char resolved[PATH_MAX];
+    DirtreeError error;
+    memset(&error, 0, sizeof(error));
+    ServedTree *tree = NULL;
+    bool adopted = false;
+    if (!problem) {
+        if (!realpath(root, resolved)) {
+            error.code = DIRTREE_ERR_PATH;
+            error.sys_errno = errno;
+            snprintf(error.path, sizeof(error.path), "%s", root);
+        } else if (!is_served_root(resolved, served)) {
+            problem = "root is outside the served directory";
+        } else {
+            tree = find_served_tree(trees, resolved, &config, &adopted, now, done_fd, &error);
+        }
+    }
+    
+    // Bring the tree up to date with changes that have settled
+    if (tree && dirtree_watch_update(tree->watch, 0) < 0) {
+        error = tree->error;
+        close_served_tree(tree);
+        tree = NULL;
+    }
+    
+    if (problem) {
+        fprintf(out, "error: %s\n", problem);
+    } else if (!tree && error.code != DIRTREE_OK) {
+        print_error(out, "error", &error);
+    } else if (!tree) {
+        // The tree is still loading: read what the request asks for from disk
+        DirtreeConfig once = config;
+        once.max_depth = depth;
+        if (once.max_time_ms <= 0 || once.max_time_ms > SERVE_DISK_SCAN_MS) {
+            once.max_time_ms = SERVE_DISK_SCAN_MS;
+        }
+        once.error = &error;
+        fprintf(out, "ok\n");
+        dirtree_print_to_file(out, resolved, &once);
+    } else {
+        DirtreeConfig render = tree->config;
+        render.max_depth = depth;
+        render.format = config.format;
+        render.prune_empty = config.prune_empty;
+        render.max_entries = config.max_entries;
+        render.max_output_bytes = config.max_output_bytes;
+        render.max_time_ms = config.max_time_ms;
+        render.max_children_per_dir = config.max_children_per_dir;
+        render.index = dirtree_watch_index(tree->watch);
+        render.error = &error;
+        fprintf(out, "ok\n");
+        dirtree_print_to_file(out, NULL, &render);
+    }
+    fclose(out);
+    if (!adopted) {
+        dirtree_free_config(&config);
+    }
+    free(request);
+}
+
+// Answer requests on a Unix socket at path until interrupted
+static int serve(const char *path, const char *default_root, const DirtreeConfig *defaults) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    // Requests may name the served directory or one below it
+    char served[PATH_MAX];
+    if (!realpath(default_root, served)) {
+        fprintf(stderr, "Error: %s: %s\n", default_root, strerror(errno));
+        return -1;
+    }
+    
+    // Replace a socket left over from an earlier server, but nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || fcntl(listener, F_SETFD, FD_CLOEXEC) != 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 64) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+    
+    // Loaders wake the accept loop through this pipe
+    int loaded[2];
+    if (pipe2(loaded, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        close(listener);
+        unlink(path);
+        return -1;
+    }
+    
+    // Clients that hang up early must not end the server
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+    action.sa_handler = stop_serving;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    ServedTree trees[SERVE_MAX_TREES];
+    memset(trees, 0, sizeof(trees));
+    unsigned long requests = 0;
+    struct pollfd fds[2 + SERVE_MAX_TREES];
+    while (!serve_stopped) {
+        // Wait for a client, a loaded tree or changes in a resident one
+        int count = 0;
+        fds[count].fd = listener;
+        fds[count++].events = POLLIN;
+        fds[count].fd = loaded[0];
+        fds[count++].events = POLLIN;
+        for (int i = 0; i < SERVE_MAX_TREES; i++) {
+            if (trees[i].watch) {
+                fds[count].fd = dirtree_watch_fd(trees[i].watch);
+                fds[count++].events = POLLIN;
+            }
+        }
+        
+        // Changes are only applied once they settle, so keep waking up
+        // while trees are watched
+        int wait = count > 2 && defaults->watch_debounce_ms > 0 ? defaults->watch_debounce_ms : -1;
+        int ready = poll(fds, count, wait);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            char done[SERVE_MAX_TREES];
+            while (read(loaded[0], done, sizeof(done)) > 0) {
+            }
+            take_loaded_trees(trees);
+        }
+        for (int i = 0; i < SERVE_MAX_TREES; i++) {
+            if (trees[i].watch && dirtree_watch_update(trees[i].watch, 0) < 0) {
+                close_served_tree(&trees[i]);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                serve_client(fd, trees, served, default_root, defaults, ++requests, loaded[1]);
+            }
+        }
+    }
+    
+    // Trees still loading are waited for
+    for (int i = 0; i < SERVE_MAX_TREES; i++) {
+        if (trees[i].root) {
+            close_served_tree(&trees[i]);
+        }
+    }
+    close(loaded[0]);
+    close(loaded[1]);
+    close(listener);
+    unlink(path);
+    return 0;
+}
+#endif
+
 int main(int argc, char *argv[]) {
     // Default values
     const char *dir = ".";
+    const char *save_index = NULL;
+    const char *load_index = NULL;
+    const char *baseline_path = NULL;
+    bool watch = false;
+    const char *serve_path = NULL;
+    const char *diff_path = NULL;
     DirtreeConfig config;
+    DirtreeStats stats;
+    DirtreeError error;
     dirtree_init_config(&config);
+    config.error = &error;
     
     // Define long options
     static struct option long_options[] = {
@@ -689,6 +6582,29 @@ int main(int argc, char *argv[]) {
         {"all", no_argument, 0, 'a'},
         {"unicode", no_argument, 0, 'u'},
         {"ascii", no_argument, 0, 'A'},
+        {"stat", no_argument, 0, 'S'},
+        {"stats", no_argument, 0, 's'},
+        {"dirent-buffer", required_argument, 0, 'b'},
+        {"io-uring", no_argument, 0, 'i'},
+        {"threads", required_argument, 0, 'j'},
+        {"cycles", required_argument, 0, 'C'},
+        {"metadata", no_argument, 0, 'm'},
+        {"gitignore", no_argument, 0, 'g'},
+        {"save-index", required_argument, 0, OPT_SAVE_INDEX},
+        {"load-index", required_argument, 0, OPT_LOAD_INDEX},
+        {"baseline", required_argument, 0, OPT_BASELINE},
+        {"watch", no_argument, 0, OPT_WATCH},
+        {"debounce", required_argument, 0, OPT_DEBOUNCE},
+        {"serve", required_argument, 0, OPT_SERVE},
+        {"diff", required_argument, 0, OPT_DIFF},
+        {"include", required_argument, 0, OPT_INCLUDE},
+        {"exclude", required_argument, 0, OPT_EXCLUDE},
+        {"ext", required_argument, 0, OPT_EXT},
+        {"prune-empty", no_argument, 0, OPT_PRUNE_EMPTY},
+        {"max-entries", required_argument, 0, OPT_MAX_ENTRIES},
+        {"max-bytes", required_argument, 0, OPT_MAX_BYTES},
+        {"max-time", required_argument, 0, OPT_MAX_TIME},
+        {"max-children", required_argument, 0, OPT_MAX_CHILDREN},
         {0, 0, 0, 0}
     };
     
@@ -696,7 +6612,7 @@ int main(int argc, char *argv[]) {
     int c;
     
     // Parse options
-    while ((c = getopt_long(argc, argv, "hd:auA", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "hd:auASsb:ij:C:mg", long_options, &option_index)) != -1) {
         switch (c) {
             case 'h':
                 print_help(argv[0]);
@@ -715,6 +6631,95 @@ int main(int argc, char *argv[]) {
             case 'A':
                 config.format = DIRTREE_FORMAT_ASCII;
                 break;
+            case 'S':
+                config.use_dtype = false;
+                break;
+            case 's':
+                config.stats = &stats;
+                break;
+            case 'b':
+                config.dirent_buffer_size = (size_t)strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'i':
+                config.use_io_uring = true;
+                break;
+            case 'j':
+                config.threads = atoi(optarg);
+                break;
+            case 'C':
+                if (strcmp(optarg, "visited") == 0) {
+                    config.cycle_policy = DIRTREE_CYCLES_VISITED;
+                } else if (strcmp(optarg, "ancestors") == 0) {
+                    config.cycle_policy = DIRTREE_CYCLES_ANCESTORS;
+                } else {
+                    fprintf(stderr, "Error: unknown cycle policy '%s'.\n", optarg);
+                    dirtree_free_config(&config);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                config.collect_metadata = true;
+                break;
+            case 'g':
+                config.use_ignore_files = true;
+                break;
+            case OPT_SAVE_INDEX:
+                save_index = optarg;
+                break;
+            case OPT_LOAD_INDEX:
+                load_index = optarg;
+                break;
+            case OPT_BASELINE:
+                baseline_path = optarg;
+                break;
+            case OPT_WATCH:
+                watch = true;
+                break;
+            case OPT_DEBOUNCE:
+                config.watch_debounce_ms = atoi(optarg);
+                break;
+            case OPT_SERVE:
+                serve_path = optarg;
+                break;
+            case OPT_DIFF:
+                diff_path = optarg;
+                break;
+            case OPT_INCLUDE:
+            case OPT_EXCLUDE:
+            case OPT_EXT: {
+                // --ext takes a comma-separated list
+                int failed = 0;
+                if (c == OPT_INCLUDE) {
+                    failed = dirtree_add_include(&config, optarg);
+                } else if (c == OPT_EXCLUDE) {
+                    failed = dirtree_add_exclude(&config, optarg);
+                }
+                for (char *ext = c == OPT_EXT ? strtok(optarg, ",") : NULL; ext && !failed;
+                     ext = strtok(NULL, ",")) {
+                    failed = dirtree_add_extension(&config, ext);
+                }
+                if (failed) {
+                    fprintf(stderr, "Error: out of memory.\n");
+                    dirtree_free_config(&config);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case OPT_PRUNE_EMPTY:
+                config.prune_empty = true;
+                break;
+            case OPT_MAX_ENTRIES:
+                config.max_entries = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_MAX_BYTES:
+                config.max_output_bytes = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case OPT_MAX_TIME:
+                config.max_time_ms = atoi(optarg);
+                break;
+            case OPT_MAX_CHILDREN:
+                config.max_children_per_dir = atoi(optarg);
+                break;
             case '?':
                 // getopt_long already printed an error message
                 dirtree_free_config(&config);
@@ -729,28 +6734,120 @@ int main(int argc, char *argv[]) {
         dir = argv[optind];
     }
     
-#ifdef _WIN32
-    // Check if DIR exists and is a directory
-    DWORD attrs = GetFileAttributes(dir);
-    if (attrs == INVALID_FILE_ATTRIBUTES || !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
-        fprintf(stderr, "Error: '%s' is not a directory or doesn't exist.\n", dir);
+    // A diff only reads snapshots and the directory
+    if (diff_path && (watch || serve_path || save_index)) {
+        fprintf(stderr, "Error: --diff can't be combined with --watch, --serve or --save-index.\n");
         dirtree_free_config(&config);
         return EXIT_FAILURE;
     }
-#else
-    // Ensure DIR exists and is a directory
-    struct stat st;
-    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
-        fprintf(stderr, "Error: '%s' is not a directory or doesn't exist.\n", dir);
+    
+    // A watch keeps its own snapshot in memory
+    if (watch && (load_index || save_index)) {
+        fprintf(stderr, "Error: --watch can't be combined with --load-index or --save-index.\n");
         dirtree_free_config(&config);
         return EXIT_FAILURE;
     }
+    
+    // The server answers until interrupted; the directory and options are
+    // the defaults of its requests
+    if (serve_path) {
+        if (watch || load_index || save_index) {
+            fprintf(stderr, "Error: --serve can't be combined with --watch, --load-index or --save-index.\n");
+            dirtree_free_config(&config);
+            return EXIT_FAILURE;
+        }
+#ifdef _WIN32
+        fprintf(stderr, "Error: --serve is not supported on Windows.\n");
+        int served = -1;
+#else
+        int served = serve(serve_path, dir, &config);
 #endif
-
+        dirtree_free_config(&config);
+        return served == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    // A snapshot stands in for the directory
+    DirtreeIndex *index = NULL;
+    if (load_index) {
+        index = dirtree_index_load(load_index, &error);
+        if (!index) {
+            print_error(stderr, "Error", &error);
+            dirtree_free_config(&config);
+            return EXIT_FAILURE;
+        }
+        config.index = index;
+    } else {
+#ifdef _WIN32
+        // Check if DIR exists and is a directory
+        DWORD attrs = GetFileAttributes(dir);
+        if (attrs == INVALID_FILE_ATTRIBUTES || !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+            fprintf(stderr, "Error: '%s' is not a directory or doesn't exist.\n", dir);
+            dirtree_free_config(&config);
+            return EXIT_FAILURE;
+        }
+#else
+        // Ensure DIR exists and is a directory
+        struct stat st;
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Error: '%s' is not a directory or doesn't exist.\n", dir);
+            dirtree_free_config(&config);
+            return EXIT_FAILURE;
+        }
+#endif
+    }
+    
+    // Compare with an earlier snapshot instead of printing; the exit
+    // status follows diff(1): 0 if unchanged, 1 if changed, 2 on failure
+    if (diff_path) {
+        DirtreeIndex *old_index = dirtree_index_load(diff_path, &error);
+        int differs = old_index ? dirtree_diff_to_file(stdout, old_index, dir, &config) : -1;
+        if (differs < 0) {
+            print_error(stderr, "Error", &error);
+        }
+        dirtree_index_close(old_index);
+        dirtree_index_close(index);
+        dirtree_free_config(&config);
+        return differs < 0 ? 2 : differs;
+    }
+    
+    // A missing or unusable baseline just means a full scan
+    DirtreeIndex *baseline = NULL;
+    if (baseline_path && !index) {
+        baseline = dirtree_index_load(baseline_path, &error);
+        if (!baseline && !(error.code == DIRTREE_ERR_IO && error.sys_errno == ENOENT)) {
+            print_error(stderr, "Warning: ignoring baseline", &error);
+        }
+        config.baseline = baseline;
+    }
+    
+    // Save the snapshot first, then print from it rather than scanning twice
+    int result = 0;
+    if (watch) {
+        result = watch_and_print(dir, &config);
+    } else if (save_index) {
+        result = dirtree_index_save(dir, save_index, &config);
+        if (result == 0 && !index) {
+            index = dirtree_index_load(save_index, &error);
+            result = index ? 0 : -1;
+            config.index = index;
+        }
+    }
+    
     // Print the tree
-    int result = dirtree_print(dir, &config);
+    if (result == 0 && !watch) {
+        result = dirtree_print(dir, &config);
+    }
+    if (result != 0) {
+        print_error(stderr, "Error", &error);
+    }
+    
+    if (config.stats && !watch) {
+        print_stats(&stats, &error);
+    }
     
     // Clean up
+    dirtree_index_close(baseline);
+    dirtree_index_close(index);
     dirtree_free_config(&config);
     
     return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -11,6 +11,7 @@
 #define DIRTREE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,7 +23,59 @@ typedef enum {
     DIRTREE_FORMAT_UNICODE = 1   // Unicode characters when supported
 } DirtreeFormat;
 
-// Configuration options for directory tree traversal
+// How directories reached more than once are detected
+typedef enum {
+    DIRTREE_CYCLES_VISITED = 0,  // Remember every directory entered: each is listed once,
+                                 // memory grows with the number of directories
+    DIRTREE_CYCLES_ANCESTORS = 1 // Remember only the current branch: breaks link loops in
+                                 // O(depth) memory, but a subtree reached through several
+                                 // links is printed under each of them
+} DirtreeCyclePolicy;
+
+// Counters collected during a traversal
+typedef struct {
+    unsigned long entries_scanned; // Directory entries read (excluding . and ..)
+    unsigned long stat_calls;      // stat() calls issued to classify entries
+    unsigned long stats_avoided;   // Entries classified from d_type without stat()
+    unsigned long stats_batched;   // Entries classified by batched io_uring statx
+    unsigned long dirs_reused;     // Directories listed from config->baseline instead of read
+    size_t output_bytes;           // Size of the rendered tree, usable as the next output_size_hint
+} DirtreeStats;
+
+// Why a call failed
+typedef enum {
+    DIRTREE_OK = 0,
+    DIRTREE_ERR_INVALID = 1,     // NULL or unusable arguments
+    DIRTREE_ERR_PATH = 2,        // The root directory can't be resolved
+    DIRTREE_ERR_NOMEM = 3,       // An allocation failed and the call was abandoned
+    DIRTREE_ERR_IO = 4,          // Reading or writing a file failed
+    DIRTREE_ERR_FORMAT = 5       // A snapshot file is damaged, of another version, or too large
+} DirtreeErrorCode;
+
+// Longest path kept in a DirtreeError, including the terminator
+#define DIRTREE_ERROR_PATH_MAX 1024
+
+// Outcome of one call. Directories that can't be read don't fail the call:
+// they are counted, and the last one is described by sys_errno and path
+// until a failure overwrites them. Running out of file descriptors does
+// fail it (DIRTREE_ERR_IO with EMFILE or ENFILE), though a walk only keeps
+// about half the descriptor limit open however deep the tree goes.
+typedef struct {
+    DirtreeErrorCode code;
+    int sys_errno;               // errno of the failure (GetLastError() on Windows), 0 if none
+    char path[DIRTREE_ERROR_PATH_MAX]; // The root, or the path below it of the directory that failed (truncated)
+    unsigned long dirs_unreadable; // Directories that could not be opened or listed
+    unsigned long dirs_skipped;  // Directories not entered again under the cycle policy
+    bool truncated;              // A budget ran out and the text ends with a marker line
+} DirtreeError;
+
+// A tree snapshot mapped by dirtree_index_load
+typedef struct DirtreeIndex DirtreeIndex;
+
+// Configuration options for directory tree traversal. Calls only read a
+// configuration, except for the stats and error it points to, which each
+// call overwrites: calls running at the same time must not share those.
+// To share the rest, give each call a shallow copy with its own pointers.
 typedef struct {
     int max_depth;               // Maximum depth (-1 for unlimited)
     bool skip_hidden;            // Skip hidden files and directories
@@ -30,6 +83,27 @@ typedef struct {
     DirtreeFormat format;        // Output format
     char **custom_skip_dirs;     // Additional directories to skip (NULL-terminated array)
     char **custom_skip_files;    // Additional files to skip (NULL-terminated array)
+    bool use_dtype;              // Trust readdir d_type, stat only DT_UNKNOWN/DT_LNK entries
+    DirtreeStats *stats;         // Optional counters, reset and filled per traversal (may be NULL)
+    size_t dirent_buffer_size;   // Linux: read directories via getdents64 into a buffer of this many bytes (0 = readdir)
+    bool use_io_uring;           // Linux: batch a directory's stat calls through io_uring when available
+    int threads;                 // Threads scanning directories in parallel (1 = serial, POSIX only)
+    DirtreeCyclePolicy cycle_policy; // How repeated directories are detected
+    size_t output_size_hint;     // Expected output size in bytes; presizes dirtree_generate_string's buffer (0 = none)
+    bool collect_metadata;       // Iterator/visitor entries carry size and mtime (one stat per entry, POSIX only)
+    DirtreeError *error;         // Optional outcome, reset and filled per call (may be NULL)
+    const DirtreeIndex *index;   // Walk this snapshot instead of scanning; dirpath is then ignored (may be NULL)
+    const DirtreeIndex *baseline; // Earlier snapshot of dirpath: unchanged directories reuse its listings (may be NULL)
+    int watch_debounce_ms;       // Quiet time after a change before a watch rescans
+    bool use_ignore_files;       // Leave out what .gitignore and .ignore files in the tree exclude
+    char **include_patterns;     // Globs files must match, unless one of include_extensions does (NULL-terminated array)
+    char **include_extensions;   // Name suffixes to keep, such as "c" or "tar.gz", with or without the dot (NULL-terminated array)
+    char **exclude_patterns;     // Globs of files and directories to leave out (NULL-terminated array)
+    bool prune_empty;            // Leave directories with nothing shown below them out of the text
+    unsigned long max_entries;   // Lines of text to print at most (0 = no limit)
+    size_t max_output_bytes;     // Size of the text at most, its truncation marker included (0 = no limit)
+    int max_time_ms;             // Time to spend at most, reading included (0 = no limit)
+    int max_children_per_dir;    // Entries listed per directory, the rest summarized in one line (0 = all)
 } DirtreeConfig;
 
 // Initialize the default configuration
@@ -38,21 +112,164 @@ void dirtree_init_config(DirtreeConfig *config);
 // Free resources allocated for the configuration
 void dirtree_free_config(DirtreeConfig *config);
 
-// Add custom directory to skip
-void dirtree_add_skip_dir(DirtreeConfig *config, const char *dirname);
+// Add custom directory to skip. Returns 0, or -1 if an argument is NULL or
+// memory runs out (the configuration is left unchanged).
+int dirtree_add_skip_dir(DirtreeConfig *config, const char *dirname);
+
+// Add custom file to skip. Returns 0 or -1, like dirtree_add_skip_dir.
+int dirtree_add_skip_file(DirtreeConfig *config, const char *filename);
+
+// Filters, applied with or without the skip lists. Patterns are globs in
+// .gitignore syntax: one without a '/' is matched against entry names,
+// one with a '/' against the path below the root ("src/**/test_*"). When
+// any include pattern or extension is given, only files matching one of
+// them are kept; directories are still entered, unless every include has
+// a '/' and none can match below them. Excluded directories are never
+// opened. Each returns 0 or -1, like dirtree_add_skip_dir.
+int dirtree_add_include(DirtreeConfig *config, const char *pattern);
+int dirtree_add_extension(DirtreeConfig *config, const char *extension);
+int dirtree_add_exclude(DirtreeConfig *config, const char *pattern);
+
+// Budgets: when max_entries, max_output_bytes or max_time_ms runs out the
+// text ends with a "... (truncated: ...)" line where the next entry would
+// have been, and no more directories are read; a directory whose reading
+// the time budget interrupts is shown without its entries. A text too
+// small for the root line and the marker still gets both. Budgets apply
+// to the functions producing text only, which then scan on one thread.
 
-// Add custom file to skip
-void dirtree_add_skip_file(DirtreeConfig *config, const char *filename);
+// With max_children_per_dir, a directory lists its first entries in sorted
+// order and ends with a "... (N more files, M more dirs)" line. Only the
+// entries listed are sorted and stat'ed; the others are counted by the
+// type readdir reports, so symlinks and entries of unknown type count as
+// files unless use_dtype is off. This too applies to text only.
 
-// Generate directory tree as string
+// Generate directory tree as string; NULL on failure (see config->error)
 char *dirtree_generate_string(const char *dirpath, DirtreeConfig *config);
 
-// Print directory tree to specified file (stdout, file, etc.)
+// Print directory tree to specified file (stdout, file, etc.). Lines are
+// written as they are produced through a bounded buffer rather than after
+// the whole tree is built; with threads > 1 they start once the scan ends.
+// Returns 0, or -1 on failure (see config->error).
 int dirtree_print_to_file(FILE *output, const char *dirpath, DirtreeConfig *config);
 
 // Print directory tree to stdout
 int dirtree_print(const char *dirpath, DirtreeConfig *config);
 
+// One entry yielded by a pull-based traversal
+typedef struct {
+    const char *name;            // Valid until the next dirtree_iter_next or dirtree_iter_close
+    int depth;                   // 1 for entries of the root directory
+    bool is_dir;
+    bool is_link;                // Reached through a symlink
+    bool is_last;                // Last entry of its directory
+    bool has_metadata;           // size and mtime are set (collect_metadata)
+    unsigned long long size;
+    long long mtime;             // Seconds since the epoch
+} DirtreeEntry;
+
+// What a visitor wants the walk to do after an entry
+typedef enum {
+    DIRTREE_WALK_CONTINUE = 0,     // Go on, descending into the entry if it is a directory
+    DIRTREE_WALK_SKIP_SUBTREE = 1, // Go on, but don't open the entry's directory
+    DIRTREE_WALK_STOP = 2          // End the walk now
+} DirtreeWalkAction;
+
+// Called for each entry of dirtree_walk; the entry is only valid during the call
+typedef DirtreeWalkAction (*DirtreeVisitor)(const DirtreeEntry *entry, void *userdata);
+
+// Walk dirpath with the same rules and order as the text rendering, calling
+// visitor for every entry. threads is ignored. Returns 0 when the walk
+// completed, 1 when the visitor stopped it and -1 on failure (see config->error).
+int dirtree_walk(const char *dirpath, const DirtreeConfig *config, DirtreeVisitor visitor,
+                 void *userdata);
+
+// Pull-based traversal state
+typedef struct DirtreeIter DirtreeIter;
+
+// Start walking dirpath with the same skip, depth, cycle and sort rules as
+// the text rendering, without building it. Entries come depth-first in
+// the order they would be printed; memory grows with depth times the
+// widest directory, not with the tree. threads is ignored. The
+// configuration must stay valid until dirtree_iter_close. Returns NULL on
+// failure (see config->error).
+DirtreeIter *dirtree_iter_open(const char *dirpath, const DirtreeConfig *config);
+
+// Fetch the next entry; returns false when the traversal is complete or
+// has failed, which config->error tells apart
+bool dirtree_iter_next(DirtreeIter *iter, DirtreeEntry *entry);
+
+// Release a traversal, finished or not
+void dirtree_iter_close(DirtreeIter *iter);
+
+// Scan dirpath with config's skip, depth and cycle rules and save the tree
+// to path as a snapshot for dirtree_index_load. Directories keep their
+// mtime, ctime and inode; files keep size and mtime when collect_metadata
+// is set. The file is replaced atomically. Returns 0, or -1 on failure
+// (see config->error).
+int dirtree_index_save(const char *dirpath, const char *path, const DirtreeConfig *config);
+
+// Map a snapshot saved by dirtree_index_save, checking its version and
+// structure. With config->index pointing at it, the functions above walk
+// the snapshot instead of the disk, applying their own format, depth and
+// skip options; entries left out when it was saved stay absent. Returns
+// NULL on failure, described in error (may be NULL).
+DirtreeIndex *dirtree_index_load(const char *path, DirtreeError *error);
+
+// A snapshot can also serve as config->baseline for a later scan of the
+// same directory with the same skip, depth and cycle settings (it is
+// ignored otherwise, and whenever use_ignore_files is set). Each directory
+// is still opened and stat'ed, but one whose inode, mtime and ctime match
+// the snapshot, and that was last changed well before the snapshot was
+// taken, is listed from it instead of being read; symlinks in it are
+// classified again. The result is the same as a full scan. Saving with a
+// baseline updates a snapshot incrementally.
+
+// Unmap a snapshot; it must no longer be referenced by a configuration in use
+void dirtree_index_close(DirtreeIndex *index);
+
+// Write the differences between an earlier snapshot and config->index,
+// or dirpath scanned now with config's rules (old_index then vouches for
+// unchanged directories), as a tree of the entries added ("+ "), removed
+// ("- ") or changed ("~ "; size, mtime or symlink status) and the
+// directories leading to them. The listings are merged name by name, so
+// time is linear in the two trees and memory stays small. Sizes and
+// times are only compared when both sides recorded them
+// (collect_metadata). Returns 0 if the trees match, 1 if they differ and
+// -1 on failure (see config->error).
+int dirtree_diff_to_file(FILE *output, const DirtreeIndex *old_index, const char *dirpath,
+                         DirtreeConfig *config);
+
+// A tree kept in memory and updated as it changes on disk
+typedef struct DirtreeWatch DirtreeWatch;
+
+// Scan dirpath into memory and watch every directory listed through
+// inotify (Linux only). config->baseline, if set, speeds up this first
+// scan; later ones only read the directories events named and list the
+// others from the watch's own tree. After the event queue overflows, or
+// with use_ignore_files, a rescan checks every directory again. The
+// configuration must stay valid until dirtree_watch_close. Returns NULL
+// on failure (see config->error); running out of inotify watches is
+// DIRTREE_ERR_IO with ENOSPC.
+DirtreeWatch *dirtree_watch_open(const char *dirpath, const DirtreeConfig *config);
+
+// Wait up to timeout_ms (-1 = no limit) for changes. Once a change arrives
+// the watch waits for watch_debounce_ms without further ones (but no more
+// than ten times that in all) and then rescans. Returns 1 if the tree
+// changed, 0 if it didn't within the timeout, and -1 on failure (see
+// config->error), after which the last tree stays available.
+int dirtree_watch_update(DirtreeWatch *watch, int timeout_ms);
+
+// Descriptor that becomes readable when changes arrive, to wait on along
+// with others before calling dirtree_watch_update
+int dirtree_watch_fd(const DirtreeWatch *watch);
+
+// The current tree, for config->index; valid until the next
+// dirtree_watch_update that returns 1, or dirtree_watch_close
+const DirtreeIndex *dirtree_watch_index(const DirtreeWatch *watch);
+
+// Stop watching and free the tree
+void dirtree_watch_close(DirtreeWatch *watch);
+
 // Version information
 const char *dirtree_version(void);
 